@@ -0,0 +1,609 @@
+
+/*
+Benchmarks for xml.c
+
+Build with
+cc -O2 bench.c -lgc -o bench
+(or cc -O2 -DXML_NO_GC bench.c -o bench) and run
+./bench throughput [seconds-per-measurement]
+./bench latency [iterations] [gc|malloc|arena]
+./bench gc [copies]
+./bench pool [max-len]
+./bench scale [pieces]
+Results are printed as JSON on stdout.
+
+Throughput runs every operation over synthetic corpora of a few shapes:
+ deep      long chains of nested tags
+ wide      one tag with many small children
+ attrs     tags with lots of attributes
+ text      long runs of plain text
+ entities  text and attributes full of escaped characters
+ enums     rows whose attribute values and text come from small sets
+ wwxtp     one small wwxtp-style message, for docs per second
+
+Latency times a whole small-message round trip per iteration: parse a request,
+look a few things up in it, build a response with XML_tag and turn it into
+text.  Latencies go into a log-linear histogram so the tail percentiles are
+accurate to within about 3%, and the number of collections the GC ran during
+the measurement is reported next to them.  With the malloc backend each
+iteration frees what it made with XML_free, and with the arena backend each
+iteration works in an arena that is reset afterwards.  Built without libgc,
+there's no gc backend, and arena is the default.
+
+Gc keeps copies of the parsed text corpus alive and times full collections,
+once with every allocation scanned conservatively and once with text
+allocated atomically and tags typed, the way XML_gc_allocator does it.
+
+Pool parses each corpus into an arena, once as usual and once with a string
+pool, and reports the bytes each tree takes up along with the parse speed.
+
+Scale parses inputs of a quarter, half and all of the given number of small
+pieces in one pass each, and reports the time per piece.  It should stay flat
+as the input grows; if it doubles with the input, something is rescanning the
+rest of the input for every piece.  The shapes are:
+ stream    small documents one after another, read with XML_parse_next
+ comments  one document of comments, each between two elements
+ cdata     one document of small CDATA sections
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include "xml.c"
+#include <time.h>
+
+double seconds_per_measurement = 0.5;
+
+double now () {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct Buf {
+	char* data;
+	size_t len;
+	size_t cap;
+} Buf;
+
+void buf_printf (Buf* b, const char* fmt, ...) {
+	va_list args;
+	for (;;) {
+		va_start(args, fmt);
+		int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+		va_end(args);
+		if (b->len + n < b->cap) {
+			b->len += n;
+			return;
+		}
+		b->cap = b->cap ? b->cap * 2 : 4096;
+		while (b->cap <= b->len + n) b->cap *= 2;
+		b->data = realloc(b->data, b->cap);
+	}
+}
+
+// Each generator fills a document of about size bytes and
+// gives the names the lookup benchmark should look for
+typedef struct Corpus {
+	const char* name;
+	Buf doc;
+	const char* child;  // Looked up in the root
+	const char* attr;  // Looked up in that child
+} Corpus;
+
+void gen_deep (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<root>");
+	uint chain = 0;
+	while (c->doc.len < size) {
+		uint i;
+		for (i = 0; i < 200; i++) buf_printf(&c->doc, "<level n=\"%u\">", i);
+		buf_printf(&c->doc, "bottom %u", chain++);
+		for (i = 0; i < 200; i++) buf_printf(&c->doc, "</level>");
+	}
+	buf_printf(&c->doc, "<last n=\"0\"/></root>");
+	c->child = "last";
+	c->attr = "n";
+}
+void gen_wide (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<root>");
+	uint i = 0;
+	while (c->doc.len < size) buf_printf(&c->doc, "<item id=\"%u\">%u</item>", i, i), i++;
+	buf_printf(&c->doc, "<last id=\"%u\"/></root>", i);
+	c->child = "last";
+	c->attr = "id";
+}
+void gen_attrs (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<root>");
+	uint i = 0;
+	while (c->doc.len < size) {
+		buf_printf(&c->doc, "<record");
+		uint j;
+		for (j = 0; j < 16; j++) buf_printf(&c->doc, " field%u=\"value %u.%u\"", j, i, j);
+		buf_printf(&c->doc, "/>");
+		i++;
+	}
+	buf_printf(&c->doc, "<last");
+	uint j;
+	for (j = 0; j < 16; j++) buf_printf(&c->doc, " field%u=\"%u\"", j, j);
+	buf_printf(&c->doc, "/></root>");
+	c->child = "last";
+	c->attr = "field15";
+}
+void gen_text (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<root>");
+	while (c->doc.len < size) {
+		buf_printf(&c->doc, "<para>");
+		uint j;
+		for (j = 0; j < 40; j++) buf_printf(&c->doc, "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ");
+		buf_printf(&c->doc, "</para>");
+	}
+	buf_printf(&c->doc, "<last lang=\"la\"/></root>");
+	c->child = "last";
+	c->attr = "lang";
+}
+void gen_entities (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<root>");
+	uint i = 0;
+	while (c->doc.len < size) {
+		buf_printf(&c->doc, "<expr op=\"&lt;&amp;&gt;\" q=\"&quot;%u&quot;\">a &lt; b &amp;&amp; c &gt; d &amp; &quot;e&quot; %u</expr>", i, i);
+		i++;
+	}
+	buf_printf(&c->doc, "<last op=\"&amp;&amp;\"/></root>");
+	c->child = "last";
+	c->attr = "op";
+}
+void gen_enums (Corpus* c, size_t size) {
+	const char* statuses [] = {"active", "inactive", "pending", "retired"};
+	const char* units [] = {"kg", "m", "s", "mol"};
+	buf_printf(&c->doc, "<root>");
+	uint i = 0;
+	while (c->doc.len < size) {
+		buf_printf(&c->doc, "<row status=\"%s\" unit=\"%s\" scale=\"%u\">%s</row>",
+			statuses[i % 4], units[i / 4 % 4], i % 10, i % 3 ? "ok" : "check");
+		i++;
+	}
+	buf_printf(&c->doc, "<last status=\"active\"/></root>");
+	c->child = "last";
+	c->attr = "status";
+}
+void gen_wwxtp (Corpus* c, size_t size) {
+	buf_printf(&c->doc, "<wwxtp><query><command>POSITION</command><position lat=\"23.01515\" long=\"-15.132\"/><token>%08x</token></query></wwxtp>", 0x5eed);
+	c->child = "query";
+	c->attr = NULL;
+}
+
+typedef struct Result {
+	double seconds;
+	double iterations;
+} Result;
+
+#define MEASURE(result, body) do { \
+	double start = now(); \
+	double elapsed; \
+	double iters = 0; \
+	do { \
+		body; \
+		iters++; \
+	} while ((elapsed = now() - start) < seconds_per_measurement); \
+	(result).seconds = elapsed; \
+	(result).iterations = iters; \
+} while (0)
+
+void print_result (const char* op, Result r, size_t bytes, uint last) {
+	if (!bytes) {
+		printf("        \"%s\": {\"ops_per_s\": %.1f, \"iterations\": %.0f}%s\n",
+			op, r.iterations / r.seconds, r.iterations, last ? "" : ","
+		);
+		return;
+	}
+	printf("        \"%s\": {\"mb_per_s\": %.2f, \"docs_per_s\": %.1f, \"iterations\": %.0f}%s\n",
+		op, r.iterations * bytes / r.seconds / 1e6, r.iterations / r.seconds, r.iterations,
+		last ? "" : ","
+	);
+}
+
+volatile uintptr_t sink;
+
+// Without libgc the throughput loops have to free what they make
+#ifdef XML_NO_GC
+#define DISPOSE_XML(x) XML_free(x)
+#define DISPOSE_STR(s) XML_dealloc((void*)(s))
+#else
+#define DISPOSE_XML(x) ((void)0)
+#define DISPOSE_STR(s) ((void)0)
+#endif
+
+void run_throughput () {
+	Corpus corpora [] = {
+		{"deep"}, {"wide"}, {"attrs"}, {"text"}, {"entities"}, {"enums"}, {"wwxtp"}
+	};
+	void (* gens [])(Corpus*, size_t) = {
+		gen_deep, gen_wide, gen_attrs, gen_text, gen_entities, gen_enums, gen_wwxtp
+	};
+	uint n = sizeof(corpora) / sizeof(corpora[0]);
+	printf("{\n  \"benchmark\": \"throughput\",\n  \"corpora\": {\n");
+	uint i;
+	for (i = 0; i < n; i++) {
+		Corpus* c = &corpora[i];
+		gens[i](c, 1 << 20);
+		const char* doc = c->doc.data;
+		size_t bytes = c->doc.len;
+		XML parsed = XML_parse(doc);
+		if (!XML_is_valid(parsed)) {
+			fprintf(stderr, "Error: %s corpus failed to parse at position %u\n", c->name, failspot);
+			exit(1);
+		}
+		const char* text = XML_as_text(parsed);
+		size_t text_bytes = strlen(text);
+		Result r;
+		printf("    \"%s\": {\n      \"bytes\": %zu,\n      \"ops\": {\n", c->name, bytes);
+		MEASURE(r, XML x = XML_parse(doc); sink = (uintptr_t)x.tag; DISPOSE_XML(x));
+		print_result("parse", r, bytes, 0);
+		XML_ParseOptions strict = {XML_PARSE_VALIDATE_UTF8};
+		MEASURE(r, XML x = XML_parse_opts(doc, &strict); sink = (uintptr_t)x.tag; DISPOSE_XML(x));
+		print_result("parse_utf8", r, bytes, 0);
+		MEASURE(r, XML x = XML_parse_lazy(doc, NULL); sink = (uintptr_t)x.tag; DISPOSE_XML(x));
+		print_result("parse_lazy", r, bytes, 0);
+		MEASURE(r,
+			XML x = XML_parse_lazy(doc, NULL);
+			XML child = XML_get_child(x, c->child);
+			sink = c->attr ? (uintptr_t)XML_get_attr(child, c->attr) : (uintptr_t)child.tag;
+			DISPOSE_XML(x)
+		);
+		print_result("parse_lazy_lookup", r, bytes, 0);
+		char first [64];
+		snprintf(first, sizeof(first), "*/%s", c->child);
+		const char* const paths [] = {first, NULL};
+		XML_ParseOptions to_first = {.paths = paths};
+		MEASURE(r,
+			XML x = XML_parse_opts(doc, &to_first);
+			XML child = XML_get_child(x, c->child);
+			sink = c->attr ? (uintptr_t)XML_get_attr(child, c->attr) : (uintptr_t)child.tag;
+			DISPOSE_XML(x)
+		);
+		print_result("parse_path_lookup", r, bytes, 0);
+		MEASURE(r, const char* x = XML_as_text(parsed); sink = (uintptr_t)x; DISPOSE_STR(x));
+		print_result("as_text", r, text_bytes, 0);
+		MEASURE(r, const char* x = XML_escape(doc); sink = (uintptr_t)x; DISPOSE_STR(x));
+		print_result("escape", r, bytes, 0);
+		MEASURE(r, const char* x = XML_unescape(doc); sink = (uintptr_t)x; DISPOSE_STR(x));
+		print_result("unescape", r, bytes, 0);
+		MEASURE(r,
+			XML child = XML_get_child(parsed, c->child);
+			sink = c->attr ? (uintptr_t)XML_get_attr(child, c->attr) : (uintptr_t)child.tag
+		);
+		print_result("lookup", r, 0, 1);
+		printf("      }\n    }%s\n", i == n - 1 ? "" : ",");
+	}
+	printf("  }\n}\n");
+}
+
+// Values below HIST_SUB nanoseconds get a bucket each; above that every
+// power of two is split into HIST_HALF buckets
+#define HIST_SUB 64
+#define HIST_HALF 32
+#define HIST_BUCKETS (HIST_SUB + 58 * HIST_HALF)
+
+typedef struct Histogram {
+	uint64_t counts [HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+	double sum;
+} Histogram;
+
+uint hist_bucket (uint64_t v) {
+	if (v < HIST_SUB) return v;
+	uint shift = 63 - __builtin_clzll(v) - 5;
+	return HIST_SUB + (shift - 1) * HIST_HALF + ((v >> shift) - HIST_HALF);
+}
+uint64_t hist_bucket_top (uint b) {
+	if (b < HIST_SUB) return b;
+	uint k = b - HIST_SUB;
+	uint shift = k / HIST_HALF + 1;
+	return (((uint64_t)(HIST_HALF + k % HIST_HALF) + 1) << shift) - 1;
+}
+void hist_record (Histogram* h, uint64_t v) {
+	h->counts[hist_bucket(v)]++;
+	h->total++;
+	h->sum += v;
+	if (v > h->max) h->max = v;
+}
+uint64_t hist_percentile (Histogram* h, double p) {
+	uint64_t want = (uint64_t)(p / 100 * h->total + 0.5);
+	if (want < 1) want = 1;
+	uint64_t seen = 0;
+	uint b;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen >= want) {
+			uint64_t top = hist_bucket_top(b);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+uint64_t now_ns () {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsigned long gc_count () {
+#ifndef XML_NO_GC
+	return GC_get_gc_no();
+#else
+	return 0;
+#endif
+}
+
+void round_trip (const char* request, uint manual) {
+	XML req = XML_parse(request);
+	if (!XML_is_valid(req)) {
+		fprintf(stderr, "Error: Request failed to parse at position %u\n", failspot);
+		exit(1);
+	}
+	XML query = XML_get_child(req, "query");
+	XML command = XML_get_child(query, "command");
+	XML position = XML_get_child(query, "position");
+	XML response = XML_tag("wwxtp",
+		NULL,
+		XML_tag("response",
+			"status", "ok",
+			NULL,
+			XML_tag("command", NULL, command.tag->contents[0].str, NULL),
+			XML_tag("position",
+				"lat", XML_get_attr(position, "lat"),
+				"long", XML_get_attr(position, "long"),
+				NULL,
+				NULL
+			),
+			NULL
+		),
+		NULL
+	);
+	const char* text = XML_as_text(response);
+	sink = (uintptr_t)text;
+	if (manual) {
+		XML_dealloc((void*)text);
+		XML_free(response);
+		XML_free(req);
+	}
+}
+
+void run_latency (uint iterations, const char* backend) {
+	const char* request = "<wwxtp><query><command>POSITION</command><position lat=\"23.01515\" long=\"-15.132\"/><token>00005eed</token></query></wwxtp>";
+	static Histogram h;
+	XML_Arena* arena = NULL;
+	XML_Allocator arena_allocator;
+	if (0==strcmp(backend, "arena")) {
+		arena = XML_arena_new();
+		arena_allocator = XML_arena_allocator(arena);
+		XML_set_allocator(&arena_allocator);
+	}
+	else if (0==strcmp(backend, "malloc")) {
+		XML_set_allocator(&XML_malloc_allocator);
+	}
+	else if (0!=strcmp(backend, "gc")) {
+		fprintf(stderr, "Error: Unknown backend %s\n", backend);
+		exit(1);
+	}
+#ifdef XML_NO_GC
+	else {
+		// Its allocator is malloc's then, and nothing would ever be freed
+		fprintf(stderr, "Error: Built without libgc, so there's no gc backend\n");
+		exit(1);
+	}
+#endif
+	uint manual = 0==strcmp(backend, "malloc");
+	uint i;
+	for (i = 0; i < iterations / 10; i++) {
+		round_trip(request, manual);
+		if (arena) XML_arena_reset(arena);
+	}
+	unsigned long gc_before = gc_count();
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+		round_trip(request, manual);
+		if (arena) XML_arena_reset(arena);
+		hist_record(&h, now_ns() - start);
+	}
+	unsigned long gc_after = gc_count();
+	XML_set_allocator(NULL);
+	printf("{\n  \"benchmark\": \"latency\",\n  \"backend\": \"%s\",\n", backend);
+	printf("  \"iterations\": %u,\n", iterations);
+	printf("  \"ns\": {\"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"p99.99\": %llu, \"max\": %llu},\n",
+		h.sum / h.total,
+		(unsigned long long)hist_percentile(&h, 50),
+		(unsigned long long)hist_percentile(&h, 90),
+		(unsigned long long)hist_percentile(&h, 99),
+		(unsigned long long)hist_percentile(&h, 99.9),
+		(unsigned long long)hist_percentile(&h, 99.99),
+		(unsigned long long)h.max
+	);
+	printf("  \"gc_collections\": %lu\n}\n", gc_after - gc_before);
+}
+
+size_t arena_bytes (XML_Arena* a) {
+	size_t r = a->used;
+	XML_ArenaChunk* c;
+	for (c = a->first; c != a->chunk; c = c->next) r += c->size;
+	return r;
+}
+
+void run_pool (uint max_len) {
+	Corpus corpora [] = {{"attrs"}, {"text"}, {"entities"}, {"enums"}};
+	void (* gens [])(Corpus*, size_t) = {gen_attrs, gen_text, gen_entities, gen_enums};
+	uint n = sizeof(corpora) / sizeof(corpora[0]);
+	XML_Arena* arena = XML_arena_new();
+	XML_Allocator arena_allocator = XML_arena_allocator(arena);
+	XML_StrPool* pool = XML_pool_new(max_len);
+	XML_ParseOptions plain = {0};
+	XML_ParseOptions pooled = {0, NULL, pool};
+	printf("{\n  \"benchmark\": \"pool\",\n  \"max_len\": %u,\n  \"corpora\": {\n", max_len);
+	uint i;
+	for (i = 0; i < n; i++) {
+		Corpus* c = &corpora[i];
+		gens[i](c, 1 << 20);
+		const char* doc = c->doc.data;
+		size_t bytes = c->doc.len;
+		XML_set_allocator(&arena_allocator);
+		sink = (uintptr_t)XML_parse_opts(doc, &plain).tag;
+		size_t plain_bytes = arena_bytes(arena);
+		XML_arena_reset(arena);
+		sink = (uintptr_t)XML_parse_opts(doc, &pooled).tag;
+		size_t pooled_bytes = arena_bytes(arena) + arena_bytes(pool->arena);
+		unsigned long hits = pool->hits;
+		XML_arena_reset(arena);
+		XML_pool_reset(pool);
+		Result plain_r;
+		Result pooled_r;
+		MEASURE(plain_r, sink = (uintptr_t)XML_parse_opts(doc, &plain).tag; XML_arena_reset(arena));
+		MEASURE(pooled_r, sink = (uintptr_t)XML_parse_opts(doc, &pooled).tag; XML_arena_reset(arena); XML_pool_reset(pool));
+		XML_set_allocator(NULL);
+		printf("    \"%s\": {\"bytes\": %zu, \"tree_bytes\": %zu, \"pooled_tree_bytes\": %zu, \"shared_strings\": %lu,\n",
+			c->name, bytes, plain_bytes, pooled_bytes, hits
+		);
+		printf("      \"mb_per_s\": %.2f, \"pooled_mb_per_s\": %.2f}%s\n",
+			plain_r.iterations * bytes / plain_r.seconds / 1e6,
+			pooled_r.iterations * bytes / pooled_r.seconds / 1e6,
+			i == n - 1 ? "" : ","
+		);
+	}
+	printf("  }\n}\n");
+	XML_pool_free(pool);
+	XML_arena_destroy(arena);
+}
+
+#ifndef XML_NO_GC
+void gc_pauses (const XML_Allocator* a, const char* label, const char* doc, uint copies, uint last) {
+	XML_set_allocator(a);
+	XML* keep = GC_malloc(copies * sizeof(XML));
+	uint i;
+	for (i = 0; i < copies; i++) keep[i] = XML_parse(doc);
+	GC_gcollect();
+	double sum = 0;
+	double max = 0;
+	uint collections = 10;
+	for (i = 0; i < collections; i++) {
+		double start = now();
+		GC_gcollect();
+		double pause = now() - start;
+		sum += pause;
+		if (pause > max) max = pause;
+	}
+	printf("    \"%s\": {\"heap_bytes\": %zu, \"pause_ms\": {\"mean\": %.3f, \"max\": %.3f}}%s\n",
+		label, (size_t)GC_get_heap_size(), sum / collections * 1e3, max * 1e3, last ? "" : ","
+	);
+	sink = (uintptr_t)keep[copies - 1].tag;
+	XML_set_allocator(NULL);
+}
+
+void run_gc (uint copies) {
+	Corpus c = {"text"};
+	gen_text(&c, 1 << 20);
+	// Same as XML_gc_allocator without alloc_atomic and alloc_tag
+	XML_Allocator conservative = {XML_gc_alloc, XML_gc_realloc, XML_gc_free, NULL, NULL};
+	printf("{\n  \"benchmark\": \"gc\",\n  \"copies\": %u,\n  \"doc_bytes\": %zu,\n  \"modes\": {\n", copies, c.doc.len);
+	gc_pauses(&conservative, "conservative", c.doc.data, copies, 0);
+	GC_gcollect();
+	gc_pauses(&XML_gc_allocator, "atomic", c.doc.data, copies, 1);
+	printf("  }\n}\n");
+}
+#endif
+
+// Fills b with n pieces of the named shape
+void gen_scale (Buf* b, const char* shape, uint n) {
+	b->len = 0;
+	uint stream = 0==strcmp(shape, "stream");
+	if (!stream) buf_printf(b, "<root>");
+	uint i;
+	for (i = 0; i < n; i++) {
+		if (stream) buf_printf(b, "<msg n=\"%u\"><body>ok</body></msg>\n", i);
+		else if (0==strcmp(shape, "comments")) buf_printf(b, "<a/><!-- note %u -->", i);
+		else buf_printf(b, "<![CDATA[a<b %u]]>", i);
+	}
+	if (!stream) buf_printf(b, "</root>");
+}
+// Gives how many pieces were parsed
+uint parse_scale (const char* shape, const char* doc) {
+	if (0!=strcmp(shape, "stream")) {
+		XML x = XML_parse(doc);
+		if (!XML_is_valid(x)) return 0;
+		uint n = x.tag->n_contents;  // Comments are dropped, and CDATA sections aren't merged
+		DISPOSE_XML(x);
+		return n;
+	}
+	XML_Cursor cursor = XML_cursor(doc, NULL);
+	XML x;
+	uint n = 0;
+	while (XML_is_valid(x = XML_parse_next(&cursor))) {
+		DISPOSE_XML(x);
+		n++;
+	}
+	return n;
+}
+void run_scale (uint pieces) {
+	const char* shapes [] = {"stream", "comments", "cdata"};
+	uint n_shapes = sizeof(shapes) / sizeof(shapes[0]);
+	Buf b = {0};
+	printf("{\n  \"benchmark\": \"scale\",\n  \"shapes\": {\n");
+	uint i;
+	for (i = 0; i < n_shapes; i++) {
+		printf("    \"%s\": {\n", shapes[i]);
+		uint n;
+		for (n = pieces / 4; n <= pieces; n *= 2) {
+			gen_scale(&b, shapes[i], n);
+			double start = now();
+			uint got = parse_scale(shapes[i], b.data);
+			double elapsed = now() - start;
+			if (got != n) {
+				fprintf(stderr, "Error: %s input of %u pieces parsed as %u\n", shapes[i], n, got);
+				exit(1);
+			}
+			printf("      \"%u\": {\"bytes\": %zu, \"ns_per_piece\": %.1f}%s\n",
+				n, b.len, elapsed * 1e9 / n, n * 2 > pieces ? "" : ","
+			);
+		}
+		printf("    }%s\n", i == n_shapes - 1 ? "" : ",");
+	}
+	printf("  }\n}\n");
+	free(b.data);
+}
+
+int main (int argc, char** argv) {
+#ifndef XML_NO_GC
+	GC_init();
+#endif
+	const char* mode = argc > 1 ? argv[1] : "throughput";
+	if (0==strcmp(mode, "throughput")) {
+		if (argc > 2) seconds_per_measurement = atof(argv[2]);
+		run_throughput();
+	}
+	else if (0==strcmp(mode, "latency")) {
+#ifndef XML_NO_GC
+		const char* backend = argc > 3 ? argv[3] : "gc";
+#else
+		const char* backend = argc > 3 ? argv[3] : "arena";
+#endif
+		run_latency(argc > 2 ? atoi(argv[2]) : 1000000, backend);
+	}
+	else if (0==strcmp(mode, "pool")) {
+		run_pool(argc > 2 ? atoi(argv[2]) : 32);
+	}
+	else if (0==strcmp(mode, "scale")) {
+		run_scale(argc > 2 ? atoi(argv[2]) : 80000);
+	}
+#ifndef XML_NO_GC
+	else if (0==strcmp(mode, "gc")) {
+		run_gc(argc > 2 ? atoi(argv[2]) : 32);
+	}
+#endif
+	else {
+		fprintf(stderr, "Usage: %s throughput [seconds-per-measurement]\n", argv[0]);
+		fprintf(stderr, "       %s latency [iterations] [gc|malloc|arena]\n", argv[0]);
+		fprintf(stderr, "       %s gc [copies]\n", argv[0]);
+		fprintf(stderr, "       %s pool [max-len]\n", argv[0]);
+		fprintf(stderr, "       %s scale [pieces]\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
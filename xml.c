@@ -26,7 +26,55 @@ You can turn the XML into a string with XML_as_text()
 const char* text = XML_as_text(my_xml);
 which give you a string containing:
 <tag-name attr-name-1="attr-value-1" attr-name-2="attr-value-2">Some text &amp; stuff in the tag<child-tag/></tag-name>
+Each tag remembers its length and whether its text needs escaping the first
+time it's turned into text, so later calls are mostly memcpy.  Don't change a
+tag's fields by hand; use the functions below, which keep those caches right.
 
+XML_tag has to walk its arguments twice to count them.  XML_TAG does the
+counting at compile time, makes exactly one allocation per tag, and refuses to
+compile an odd attribute list.
+XML same_xml = XML_TAG("tag-name",
+	XML_ATTRS("attr-name-1", "attr-value-1", "attr-name-2", "attr-value-2"),
+	XML_CONTENTS(
+		XML_TEXT("Some text & stuff in the tag"),
+		XML_TAG("child-tag", XML_NONE, XML_NONE)
+	)
+);
+
+If you build lots of trees, an XML_Builder puts them in a reusable arena.
+XML_Builder* b = XML_builder_new();
+XML_builder_begin(b, "tag-name");
+XML_builder_attr(b, "attr-name-1", "attr-value-1");
+XML_builder_text(b, "Some text & stuff in the tag");
+XML_builder_begin(b, "child-tag");
+XML_builder_end(b);
+XML built = XML_builder_end(b);  // Ending the outermost tag gives you the tree
+XML_builder_reset(b);  // Trees built so far are gone, but the memory is kept
+The setters below refuse a builder's trees, since they'd need memory from
+outside its arena.
+
+If you're only going to turn the tree into text anyway, skip the tree and use
+an XML_Writer.  It escapes as it goes and remembers which tags to close.
+XML_Writer* w = XML_writer_new(NULL, NULL);  // Or give a sink function and its context
+XML_writer_open(w, "tag-name");
+XML_writer_attr(w, "attr-name-1", "attr-value-1");
+XML_writer_text(w, "Some text & stuff in the tag");
+XML_writer_open(w, "child-tag");
+XML_writer_close(w, "child-tag");  // Debug builds check the name; NULL skips that
+XML_writer_close(w, NULL);
+const char* written = XML_writer_finish(w);
+When most of a response never changes, compile it into a template once.  Put
+XML_SLOT_TEXT(n), XML_SLOT_RAW(n) or XML_SLOT_INT(n) where the n-th variable
+attribute value or text goes, then render with an XML_Slot for each n.
+XML_Template* tmpl = XML_compile(XML_tag("position",
+	"lat", XML_SLOT_TEXT(0),
+	"long", XML_SLOT_TEXT(1),
+	NULL,
+	XML_SLOT_INT(2),
+	NULL
+));
+XML_Slot slots [] = {{.str = "23.01515"}, {.str = "-15.132"}, {.num = 42}};
+const char* rendered = XML_render(tmpl, slots);  // <position lat="23.01515" long="-15.132">42</position>
 
 You can find a tag that is a child of another tag by name with XML_get_child()
 XML child = XML_get_child(my_xml, "child-tag")  // Yields <child-tag/>
@@ -34,6 +82,30 @@ XML child = XML_get_child(my_xml, "child-tag")  // Yields <child-tag/>
 You can get the value of an attribute of a tag by name with XML_get_attr()
 const char* val = XML_get_attr(my_xml, "attr-name-2")  // Yields "attr-value-2"
 
+You can change a tree after it's made.  Tags that own their strings get copies
+of the ones you give them; the others borrow them.  Each returns 0 on failure.
+XML_set_attr(my_xml, "attr-name-2", "new-value");
+XML_append_child(my_xml, XML_tag("another-child", NULL, NULL));
+XML_insert_child(my_xml, 0, XML_TEXT("First "));
+XML_remove_child(my_xml, 1);  // Frees it
+XML_set_text(XML_get_child(my_xml, "child-tag"), "Now it has text");
+A tag can only be in one tree at a time.  If you keep a big tree around and
+turn it into text after every few changes, XML_track(tree) makes XML_as_text
+keep the text and only render again the tags that changed since then.
+Borrowed strings can be changed in place between renders, except under a
+tracked or frozen tag, whose text and length are kept.
+
+Or freeze a tree and make new versions of it instead of changing it.  A new
+version copies only the tags on the path down to what changed and shares the
+rest, so old versions stay good, and other threads can read any version
+without locking.  A path gives the index into the contents at each level.
+XML base = XML_freeze(parsed);
+uint path [] = {0, 1};  // The position tag in the query tag
+XML mine = XML_update(base, path, 2, XML_with_attr(XML_at(base, path, 2), "lat", "0"));
+XML_appended, XML_with_child and XML_without_child make other new tags.  The
+setters above refuse to change frozen tags, and XML_free won't free them, since
+they may be shared, so make them with libgc or in an arena.
+
 
 You can parse an XML string with XML_parse()
 XML parsed = XML_parse("<wwxtp><query><command>TEST</command><position lat=\"23.01515\" long=\"-15.132\"/></query></wwxtp>");
@@ -42,6 +114,152 @@ if (!XML_is_valid(parsed)) {
 	fprintf(stderr, "Syntax error in XML.\n");
 	send_error_message();
 }
+The parser decodes the five predefined entities and character references like
+&#x2603; into UTF-8.  Anything else after a '&' is kept as it is, including
+references to characters XML doesn't allow, like &#1; or &#xFFFE;.  XML_unescape
+does the same to a string, and XML_unescape_in_place to a string of yours.
+XML_parse_opts takes an XML_ParseOptions for more control; all zeroes is the
+same as XML_parse.  With XML_PARSE_VALIDATE_UTF8 in its flags, the parse fails
+on malformed UTF-8 and on characters XML doesn't allow, whether they're written
+out or as references, in the prolog too, and failspot says where.
+XML_ParseOptions strict = {XML_PARSE_VALIDATE_UTF8};
+XML checked = XML_parse_opts(input, &strict);
+For indented input, XML_PARSE_DROP_WHITESPACE leaves out text that's only
+whitespace, and XML_PARSE_TRIM_TEXT does that and trims the rest as well.
+The XML declaration, a doctype, comments and processing instructions around
+the root are skipped.  CDATA sections become plain text, copied without being
+unescaped.  Comments and processing instructions inside the root are skipped
+too, unless XML_PARSE_KEEP_COMMENTS or XML_PARSE_KEEP_PIS is in the flags; then
+they're kept as tags flagged XML_COMMENT (the text is the name) or XML_PI (the
+target is the name and the rest, if any, is the only content).  XML_get_child
+never finds them, and they turn back into text as they were.
+With XML_PARSE_NAMESPACES, prefixes are resolved as the parse goes, and a
+prefix that isn't bound fails it.  Namespace URIs are interned, so XML_ns gives
+the same pointer for the same URI, and lookups compare namespaces by pointer.
+XML_ParseOptions with_ns = {XML_PARSE_NAMESPACES};
+XML env = XML_parse_opts(soap_input, &with_ns);
+const char* soap = XML_ns("http://schemas.xmlsoap.org/soap/envelope/");
+XML body = XML_get_child_ns(env, soap, "Body");  // Whatever prefix it had
+const char* id = XML_get_attr_ns(body, NULL, "id");  // Unprefixed attributes have no namespace
+XML_set_attr resolves the prefix of a new attribute through the xmlns
+attributes on the tag and above it, so it can be found with XML_get_attr_ns
+too.  Otherwise namespaces are only worked out by the parser; tags from XML_tag
+and XML_TAG have none, and changing an xmlns attribute later doesn't change
+the namespaces of names already resolved with it.
+
+XML_hash gives a hash of a tree's structure, and XML_equal compares two trees,
+giving up early when their hashes differ.  Each tag keeps its hash, and changes
+only clear it on the way up, so hashing again after a change is cheap.  With
+XML_PARSE_HASH the parser hashes every tag as it goes.  To share identical
+subtrees instead of storing them over and over, parse through a cons table.
+XML_ConsTable* cons = XML_cons_new();
+XML_ParseOptions consing = {0, cons};
+XML catalog = XML_parse_opts(input, &consing);  // Repeated items are one tag
+Trees parsed this way are frozen and belong to the table, so XML_free leaves
+them alone, and XML_cons_free(cons) frees them all at once.
+When the same attribute values and text come up again and again, a string pool
+keeps one copy of each string shorter than the length you give, and puts all
+the parser's strings in one arena instead of allocating each on its own.
+XML_StrPool* strs = XML_pool_new(32);
+XML_ParseOptions pooled = {0, NULL, strs};
+XML rows = XML_parse_opts(input, &pooled);
+printf("%zu bytes of strings, %zu saved\n", strs->bytes, strs->saved);
+Trees parsed this way don't own their strings, so XML_free leaves them to the
+pool.  XML_pool_reset(strs) drops them all and keeps the memory for the next
+document, and XML_pool_free(strs) gives it back.  Don't share a pool between
+threads without a lock.
+To make only part of a document, give XML_ParseOptions NULL-terminated lists
+of names to include or exclude, or of paths from the root.  Elements that
+aren't kept are checked and skipped without making anything.  An included
+element is kept with everything in it, wherever it is, and so are the
+elements it's in, but with only their attributes and the included elements
+under them.  An excluded element is never kept or looked into.  A path
+keeps the elements along it and everything in the one at its end, "*" matches
+any name, and once every path has found its element the parse stops there and
+gives back the tree made so far.  endspot says how much of the input was read.
+const char* const route [] = {"wwxtp/query/command", NULL};
+XML_ParseOptions routing = {.paths = route};
+XML head = XML_parse_opts(input, &routing);  // Just wwxtp, query and command
+The root is always kept.  More than XML_MAX_PATHS paths fails the parse.
+Lazy parses ignore these lists.
+XML_parse fails on anything after the root.  For logs and sockets that send
+one document after another, read them one at a time through a cursor.
+XML_Cursor log = XML_cursor(input, NULL);  // Or give it an XML_ParseOptions
+XML entry;
+while (XML_is_valid(entry = XML_parse_next(&log))) handle(entry);
+if (log.at != log.len) fprintf(stderr, "Bad document at %u\n", failspot);
+Whitespace, comments and XML declarations between documents are skipped, and
+log.consumed says how many bytes the last call used.  Whenever the input ends
+before a document does, the call fails with failspot at log.len and leaves
+log.at at the document's start, so with a stream you can add what comes next,
+update src and len, and call again.  Any other failspot is a syntax error.
+
+If you only ever look at a little of each document, parse it lazily.  The
+whole input is still checked, but all that's made is an index of where each
+element is.  A tag's attributes and contents are made the first time one of
+the functions here looks at them, and its child tags start out lazy too.
+XML req = XML_parse_lazy(input, NULL);  // Or give it an XML_ParseOptions
+const char* cmd = XML_get_attr(XML_get_child(req, "query"), "command");  // Only req and query are made
+The input has to stay around as long as the tree does.  Call XML_expand(tag)
+before reading a lazy tag's fields yourself, and freeze a lazy tree before
+sharing it between threads, since looking at it changes it.  Namespaces,
+hashing and cons tables aren't done lazily, so those options are ignored.
+
+
+You can snapshot a tree into a relocatable binary image with XML_save_binary()
+uint size;
+const char* image = XML_save_binary(parsed, &size);
+fwrite(image, 1, size, file);
+The image holds only offsets, so it can be mmapped later and queried in place
+without parsing or allocating anything.  XML_load_binary() checks the header
+and checksum and gives you a handle to the root, or an invalid handle.
+XML_Bin root = XML_load_binary(mapped, mapped_size);
+if (XML_bin_is_valid(root)) {
+	XML_Bin query = XML_bin_get_child(root, "query");
+	const char* lat = XML_bin_get_attr(XML_bin_get_child(query, "position"), "lat");
+}
+XML_bin_to_xml() turns a handle back into a regular tree whose strings point
+into the image.  Every offset is checked against the image's size, so an
+invalid handle or a damaged image gives NULL, 0 or another invalid handle
+instead of reading out of bounds.
+
+
+If you parse the same messages over and over, put an XML_Cache in front of
+the parser.  Identical input gives back the same tree, so trees from the cache
+come back frozen (see XML_freeze): the setters refuse them, and XML_with_*
+makes changed copies that borrow from them.  Least recently used trees are
+dropped once the cache holds more than the given number of bytes.
+XML_Cache* cache = XML_cache_new(16 << 20);
+XML msg = XML_cache_parse(cache, input);  // Same as XML_parse(input), maybe faster
+XML conf = XML_cache_parse_file(cache, "/etc/thing.xml");  // Reread only if changed
+printf("%lu hits, %lu misses\n", cache->hits, cache->misses);
+
+
+Memory comes from libgc unless you say otherwise.  XML_set_allocator picks an
+XML_Allocator for the current thread, and XML_parse_with for one parse.
+There's XML_malloc_allocator, XML_gc_allocator, and arenas, which let you
+throw away a whole document at once:
+XML_Arena* arena = XML_arena_new();
+XML_Allocator arena_allocator = XML_arena_allocator(arena);
+XML doc = XML_parse_with(&arena_allocator, input);
+XML_arena_reset(arena);  // doc is gone, but the arena's memory will be reused
+Without libgc, free trees yourself with XML_free, using the allocator they were
+made with.  A tag owns its child tags.  Parsed tags own their strings, but
+XML_tag and XML_TAG only borrow the strings you give them, so those have to
+outlive the tree and are yours to free.  Strings from XML_as_text, XML_escape
+and XML_unescape are freed with XML_dealloc, and XML_Cache, XML_Writer and
+XML_Builder have XML_cache_free, XML_writer_free and XML_builder_free.  Trees
+from a cache belong to it.  Without libgc, hand each one back with
+XML_cache_release(cache, tree) when you're done; a tree that's been dropped or
+was too big to keep stays alive until then.  XML_cache_free frees them all.
+Compile with -DXML_NO_GC to do without libgc entirely.  XML_Cache, XML_Writer
+and XML_Builder keep using the allocator that was current when they were made.
+
+
+Compile with -DXML_STATS and you can ask how much work has been done
+XML_Stats stats;
+XML_stats_get(&stats);
+printf("%llu allocations, %llu ns parsing\n", stats.allocs, stats.phase_ns[XML_PHASE_PARSE]);
 
 
 BUGS: Giving an empty string as one of the children in XML_tag will confuse
@@ -55,24 +273,85 @@ BUGS: Giving an empty string as one of the children in XML_tag will confuse
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#ifndef XML_NO_GC
 #include <gc/gc.h>
+#include <gc/gc_typed.h>
+#endif
 #include <ctype.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef unsigned int uint;
 typedef union XML XML;
 
+// Counts macro arguments at compile time for XML_TAG
+#define XML_NONE 0, NULL
+#define XML_ATTRS(...) \
+	(sizeof((const char*[]){__VA_ARGS__}) / sizeof(const char*) \
+	 + 0 * sizeof(char[1 - 2 * (sizeof((const char*[]){__VA_ARGS__}) / sizeof(const char*) % 2)])), \
+	(const char*[]){__VA_ARGS__}
+#define XML_CONTENTS(...) sizeof((XML[]){__VA_ARGS__}) / sizeof(XML), (XML[]){__VA_ARGS__}
+#define XML_TEXT(s) ((XML)(const char*)(s))
+#define XML_TAG(name, attrs, contents) XML_tag_n(name, attrs, contents)
+
+// Stand-ins for the variable parts of a template (see XML_compile).  n can be
+// any expression, not just a literal.
+#define XML_SLOT_TEXT(n) XML_slot('t', (n))  // A string, escaped
+#define XML_SLOT_RAW(n) XML_slot('r', (n))  // A string that's already XML
+#define XML_SLOT_INT(n) XML_slot('i', (n))  // A long, in decimal
+
 typedef struct XML_Attr {
 	const char* name;
 	const char* value;
 } XML_Attr;
 
+// What XML_free does with a tag
+enum {
+	XML_OWNS_STRINGS = 1,  // Its name, attributes and text were allocated for it
+	XML_ONE_BLOCK = 2,  // Its attribute and content arrays share its allocation
+	XML_IN_ARENA = 4,  // It and everything under it belong to an XML_Builder
+	XML_CLEAN_TEXT = 8,  // None of its attribute values or text need escaping
+	XML_DIRTY = 16,  // Changed since a tracked XML_as_text last rendered it
+	XML_TRACKED = 32,  // XML_as_text keeps its text around (see XML_track)
+	XML_FROZEN = 64,  // It and everything under it may be shared, so never change
+	XML_COMMENT = 128,  // Not an element but <!--name-->
+	XML_PI = 256,  // Not an element but <?name contents[0]?>
+	XML_MISC = XML_COMMENT | XML_PI,
+	XML_LAZY = 512,  // Its attributes and contents haven't been made yet (see XML_parse_lazy)
+	XML_POOL_STRINGS = 1024  // All its strings are in an XML_StrPool
+};
+
+typedef struct XML_Index XML_Index;
+// What only namespaced, tracked or lazy tags need, kept apart so the rest
+// don't pay for it.  A tag gets one the first time it's needed (see XML_extra).
+typedef struct XML_TagExtra {
+	const char* ns;  // An interned namespace URI (see XML_ns), or NULL
+	const char* local;  // Its name after any prefix, or NULL if there's none
+	const char** attr_ns;  // A namespace for each attribute, or NULL if none have one
+	const char* text;  // Its last tracked rendering, if it was the one rendered
+	uint text_off;  // Where it starts in its parent's last tracked rendering
+	uint index_at;  // Its entry in the index; the root's, 0, owns the index
+	const XML_Index* index;  // For a lazily parsed tag, where it is in its source
+} XML_TagExtra;
 typedef struct XML_Tag {
 	uint is_str;
+	uint flags;
 	const char* name;
 	uint n_attrs;
+	uint len;  // Cached XML_strlen, 0 until it's first needed
 	XML_Attr* attrs;
 	uint n_contents;
+	uint cap_attrs;
 	XML* contents;
+	uint cap_contents;
+	struct XML_Tag* parent;
+	uint64_t hash;  // Cached XML_hash, 0 until it's first needed
+	XML_TagExtra* extra;  // Or NULL
 } XML_Tag;
 
 union XML {
@@ -80,60 +359,449 @@ union XML {
 	const char* str;
 };
 
+// For XML_parse_opts; zero means the same as XML_parse
+enum {
+	XML_PARSE_VALIDATE_UTF8 = 1,  // Fail on bad UTF-8 or characters XML forbids
+	XML_PARSE_KEEP_COMMENTS = 2,  // Keep comments inside the root as XML_COMMENT tags
+	XML_PARSE_KEEP_PIS = 4,  // Keep processing instructions inside the root as XML_PI tags
+	XML_PARSE_NAMESPACES = 8,  // Resolve prefixes into ns, local and attr_ns
+	XML_PARSE_DROP_WHITESPACE = 16,  // Leave out text that's only whitespace
+	XML_PARSE_TRIM_TEXT = 32,  // And take whitespace off both ends of the rest
+	XML_PARSE_HASH = 64  // Work out XML_hash for every tag as it's made
+};
+#define XML_MAX_PATHS 64
+typedef struct XML_ConsTable XML_ConsTable;
+typedef struct XML_StrPool XML_StrPool;
+typedef struct XML_ParseOptions {
+	uint flags;
+	XML_ConsTable* cons;  // Share identical subtrees through this table (see XML_cons_new)
+	XML_StrPool* pool;  // Keep strings here, sharing the short ones (see XML_pool_new)
+	const char* const* include;  // Keep only elements with these names, NULL-terminated
+	const char* const* exclude;  // Leave out elements with these names, NULL-terminated
+	const char* const* paths;  // Keep only what's on these paths, then stop (up to XML_MAX_PATHS, NULL-terminated)
+} XML_ParseOptions;
+// For XML_parse_next, which reads one document after another out of src
+typedef struct XML_Cursor {
+	const char* src;  // NUL-terminated
+	uint len;  // strlen(src); update both if you add to it
+	uint at;  // Where the next document starts
+	uint consumed;  // How far the last call moved at
+	const XML_ParseOptions* o;  // Or NULL
+} XML_Cursor;
+
 uint XML_is_str (XML);
 uint XML_is_valid (XML);
 uint XML_strlen (XML);
 const char* XML_escape (const char*);
 const char* XML_unescape (const char*);
 const char* XML_as_text (XML);
+void XML_free (XML);
 const char* XML_get_attr (XML, const char*);
 XML XML_get_child (XML, const char*);
+XML XML_tag_n (const char*, uint, const char* const*, uint, const XML*);
+const char* XML_save_binary (XML, uint*);
+size_t XML_mem_size (XML);
+uint64_t XML_hash_bytes (const void*, size_t);
+uint64_t XML_hash (XML);
+XML_Tag* XML_cons (XML_ConsTable*, XML_Tag*);
+void XML_expand (XML);
+void XML_index_free (XML_Index*);
+
+
+// Compile with -DXML_STATS to count what the library does.  Each thread counts
+// into plain thread-local counters and adds them to its own block at the end
+// of each timed call, and XML_stats_get adds the blocks up when asked.  Phases
+// are timed only where they're entered from outside, so the unescaping a parse
+// does counts as parsing, and serialize includes the escaping it does.
+enum {
+	XML_PHASE_PARSE,
+	XML_PHASE_UNESCAPE,
+	XML_PHASE_ESCAPE,
+	XML_PHASE_SERIALIZE,
+	XML_N_PHASES
+};
+
+typedef struct XML_Stats {
+	unsigned long long allocs;
+	unsigned long long alloc_bytes;
+	unsigned long long reallocs;
+	unsigned long long nodes;
+	unsigned long long bytes_scanned;
+	unsigned long long phase_ns [XML_N_PHASES];
+} XML_Stats;
+
+#ifdef XML_STATS
+#include <time.h>
+
+typedef struct XML_StatsBlock {
+	XML_Stats stats;
+	uint depth [XML_N_PHASES];
+	unsigned long long start [XML_N_PHASES];
+	struct XML_StatsBlock* next;
+} XML_StatsBlock;
+
+XML_StatsBlock* XML_stats_blocks = NULL;
+pthread_mutex_t XML_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread XML_StatsBlock* XML_stats_mine = NULL;
+__thread XML_Stats XML_stats_pending;  // Not in the block yet
+
+// Blocks are never freed, so counts from finished threads stay in the totals
+XML_StatsBlock* XML_stats_block () {
+	if (!XML_stats_mine) {
+		XML_stats_mine = calloc(1, sizeof(XML_StatsBlock));
+		pthread_mutex_lock(&XML_stats_lock);
+		XML_stats_mine->next = XML_stats_blocks;
+		XML_stats_blocks = XML_stats_mine;
+		pthread_mutex_unlock(&XML_stats_lock);
+	}
+	return XML_stats_mine;
+}
+// Only the owning thread writes a counter, so a relaxed store is enough
+void XML_stats_add (unsigned long long* counter, unsigned long long n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+unsigned long long XML_stats_now () {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+void XML_stats_publish (XML_StatsBlock* b) {
+	XML_Stats* p = &XML_stats_pending;
+	XML_stats_add(&b->stats.allocs, p->allocs);
+	XML_stats_add(&b->stats.alloc_bytes, p->alloc_bytes);
+	XML_stats_add(&b->stats.reallocs, p->reallocs);
+	XML_stats_add(&b->stats.nodes, p->nodes);
+	XML_stats_add(&b->stats.bytes_scanned, p->bytes_scanned);
+	memset(p, 0, sizeof(XML_Stats));
+}
+void XML_phase_begin (uint phase) {
+	XML_StatsBlock* b = XML_stats_block();
+	if (!b->depth[phase]++) b->start[phase] = XML_stats_now();
+}
+void XML_phase_end (uint phase) {
+	XML_StatsBlock* b = XML_stats_block();
+	if (!--b->depth[phase]) {
+		XML_stats_add(&b->stats.phase_ns[phase], XML_stats_now() - b->start[phase]);
+		XML_stats_publish(b);
+	}
+}
+// Counts another thread made since its last timed call aren't in yet
+void XML_stats_get (XML_Stats* out) {
+	XML_stats_publish(XML_stats_block());
+	memset(out, 0, sizeof(XML_Stats));
+	pthread_mutex_lock(&XML_stats_lock);
+	XML_StatsBlock* b;
+	for (b = XML_stats_blocks; b; b = b->next) {
+		out->allocs += __atomic_load_n(&b->stats.allocs, __ATOMIC_RELAXED);
+		out->alloc_bytes += __atomic_load_n(&b->stats.alloc_bytes, __ATOMIC_RELAXED);
+		out->reallocs += __atomic_load_n(&b->stats.reallocs, __ATOMIC_RELAXED);
+		out->nodes += __atomic_load_n(&b->stats.nodes, __ATOMIC_RELAXED);
+		out->bytes_scanned += __atomic_load_n(&b->stats.bytes_scanned, __ATOMIC_RELAXED);
+		uint i;
+		for (i = 0; i < XML_N_PHASES; i++)
+			out->phase_ns[i] += __atomic_load_n(&b->stats.phase_ns[i], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&XML_stats_lock);
+}
+#define XML_STAT_ADD(field, n) (XML_stats_pending.field += (n))
+#define XML_PHASE_BEGIN(phase) XML_phase_begin(phase)
+#define XML_PHASE_END(phase) XML_phase_end(phase)
+#else
+void XML_stats_get (XML_Stats* out) { memset(out, 0, sizeof(XML_Stats)); }
+#define XML_STAT_ADD(field, n) ((void)sizeof(n))
+#define XML_PHASE_BEGIN(phase) ((void)0)
+#define XML_PHASE_END(phase) ((void)0)
+#endif
+
+// Where the library's memory comes from.  Memory from alloc and realloc
+// doesn't have to be zeroed.  free and reset can be NULL if the allocator
+// can't do them; reset drops everything allocated so far in one go.
+// alloc_atomic is for memory that will never hold pointers, and alloc_tag for
+// a lone XML_Tag; when they're NULL alloc is used instead.
+typedef struct XML_Allocator {
+	void* (* alloc ) (void* ctx, size_t n);
+	void* (* realloc ) (void* ctx, void* p, size_t old, size_t n);
+	void (* free ) (void* ctx, void* p);
+	void (* reset ) (void* ctx);
+	void* ctx;
+	void* (* alloc_atomic ) (void* ctx, size_t n);
+	void* (* alloc_tag ) (void* ctx, size_t n);
+} XML_Allocator;
+
+void* XML_malloc_alloc (void* ctx, size_t n) { return malloc(n ? n : 1); }
+void* XML_malloc_realloc (void* ctx, void* p, size_t old, size_t n) { return realloc(p, n ? n : 1); }
+void XML_malloc_free (void* ctx, void* p) { free(p); }
+const XML_Allocator XML_malloc_allocator = {XML_malloc_alloc, XML_malloc_realloc, XML_malloc_free, NULL, NULL};
+
+#ifndef XML_NO_GC
+void* XML_gc_alloc (void* ctx, size_t n) { return GC_malloc(n); }
+void* XML_gc_realloc (void* ctx, void* p, size_t old, size_t n) { return GC_realloc(p, n); }
+void XML_gc_free (void* ctx, void* p) { GC_free(p); }
+// Text never holds pointers, so the collector doesn't need to look through it
+void* XML_gc_alloc_atomic (void* ctx, size_t n) { return GC_malloc_atomic(n); }
+// Only name, attrs, contents, parent and extra are pointers the collector has
+// to follow in a tag.  Keep this in sync with XML_Tag, or the collector will
+// miss whatever the new fields point to.
+GC_descr XML_tag_descr = 0;
+void* XML_gc_alloc_tag (void* ctx, size_t n) {
+	if (!XML_tag_descr) {
+		GC_word bitmap [GC_BITMAP_SIZE(XML_Tag)] = {0};
+		GC_set_bit(bitmap, GC_WORD_OFFSET(XML_Tag, name));
+		GC_set_bit(bitmap, GC_WORD_OFFSET(XML_Tag, attrs));
+		GC_set_bit(bitmap, GC_WORD_OFFSET(XML_Tag, contents));
+		GC_set_bit(bitmap, GC_WORD_OFFSET(XML_Tag, parent));
+		GC_set_bit(bitmap, GC_WORD_OFFSET(XML_Tag, extra));
+		XML_tag_descr = GC_make_descriptor(bitmap, GC_WORD_LEN(XML_Tag));
+	}
+	return GC_malloc_explicitly_typed(n, XML_tag_descr);
+}
+const XML_Allocator XML_gc_allocator = {
+	XML_gc_alloc, XML_gc_realloc, XML_gc_free, NULL, NULL,
+	XML_gc_alloc_atomic, XML_gc_alloc_tag
+};
+#define XML_default_allocator XML_gc_allocator
+// Memory the library keeps for itself has to be visible to the collector
+#define XML_sys_alloc GC_malloc
+#define XML_sys_free GC_free
+#else
+#define XML_default_allocator XML_malloc_allocator
+#define XML_sys_alloc malloc
+#define XML_sys_free free
+#endif
+
+// An arena hands out memory from big chunks and frees it all at once
+typedef struct XML_ArenaChunk {
+	struct XML_ArenaChunk* next;
+	size_t size;
+} XML_ArenaChunk;
+
+typedef struct XML_Arena {
+	XML_ArenaChunk* first;
+	XML_ArenaChunk* chunk;
+	size_t used;
+	void* last;  // Can be grown in place
+} XML_Arena;
+
+XML_Arena* XML_arena_new () {
+	XML_Arena* r = XML_sys_alloc(sizeof(XML_Arena));
+	r->first = XML_sys_alloc(sizeof(XML_ArenaChunk) + 4096);
+	r->first->next = NULL;
+	r->first->size = 4096;
+	r->chunk = r->first;
+	r->used = 0;
+	r->last = NULL;
+	return r;
+}
+void* XML_arena_alloc (void* ctx, size_t n) {
+	XML_Arena* a = ctx;
+	n = (n + 7) & ~(size_t)7;
+	while (a->used + n > a->chunk->size) {
+		if (!a->chunk->next || a->chunk->next->size < n) {
+			size_t size = a->chunk->size * 2;
+			while (size < n) size *= 2;
+			XML_ArenaChunk* c = XML_sys_alloc(sizeof(XML_ArenaChunk) + size);
+			c->size = size;
+			c->next = a->chunk->next;
+			a->chunk->next = c;
+		}
+		a->chunk = a->chunk->next;
+		a->used = 0;
+	}
+	void* r = (char*)(a->chunk + 1) + a->used;
+	a->used += n;
+	a->last = r;
+	return r;
+}
+void* XML_arena_realloc (void* ctx, void* p, size_t old, size_t n) {
+	XML_Arena* a = ctx;
+	if (p && p == a->last) {
+		size_t start = (char*)p - (char*)(a->chunk + 1);
+		size_t end = start + ((n + 7) & ~(size_t)7);
+		if (end <= a->chunk->size) {
+			a->used = end;
+			return p;
+		}
+	}
+	void* r = XML_arena_alloc(ctx, n);
+	if (p) memcpy(r, p, old < n ? old : n);
+	return r;
+}
+// Keeps the chunks for reuse
+void XML_arena_reset (void* ctx) {
+	XML_Arena* a = ctx;
+	a->chunk = a->first;
+	a->used = 0;
+	a->last = NULL;
+}
+void XML_arena_destroy (XML_Arena* a) {
+	XML_ArenaChunk* c = a->first;
+	while (c) {
+		XML_ArenaChunk* next = c->next;
+		XML_sys_free(c);
+		c = next;
+	}
+	XML_sys_free(a);
+}
+XML_Allocator XML_arena_allocator (XML_Arena* a) {
+	XML_Allocator r = {XML_arena_alloc, XML_arena_realloc, NULL, XML_arena_reset, a};
+	return r;
+}
 
+__thread const XML_Allocator* XML_thread_allocator = NULL;
 
-uint XML_is_str (XML xml) { return xml.tag->is_str; }
+// Whether memory from a goes away by itself once nothing points to it
+uint XML_is_collected (const XML_Allocator* a) {
+#ifndef XML_NO_GC
+	return a == &XML_gc_allocator;
+#else
+	return 0;
+#endif
+}
+
+const XML_Allocator* XML_allocator () {
+	return XML_thread_allocator ? XML_thread_allocator : &XML_default_allocator;
+}
+// Picks the allocator for this thread and gives back the old one.  NULL goes
+// back to the default, which is libgc unless compiled with -DXML_NO_GC.
+const XML_Allocator* XML_set_allocator (const XML_Allocator* a) {
+	const XML_Allocator* r = XML_allocator();
+	XML_thread_allocator = a;
+	return r;
+}
+
+void* XML_alloc_in (const XML_Allocator* a, size_t n) {
+	XML_STAT_ADD(allocs, 1);
+	XML_STAT_ADD(alloc_bytes, n);
+	return a->alloc(a->ctx, n);
+}
+void* XML_realloc_in (const XML_Allocator* a, void* p, size_t old, size_t n) {
+	XML_STAT_ADD(reallocs, 1);
+	if (n > old) XML_STAT_ADD(alloc_bytes, n - old);
+	return a->realloc(a->ctx, p, old, n);
+}
+void XML_dealloc_in (const XML_Allocator* a, void* p) {
+	if (p && a->free) a->free(a->ctx, p);
+}
+void* XML_alloc_atomic_in (const XML_Allocator* a, size_t n) {
+	if (!a->alloc_atomic) return XML_alloc_in(a, n);
+	XML_STAT_ADD(allocs, 1);
+	XML_STAT_ADD(alloc_bytes, n);
+	return a->alloc_atomic(a->ctx, n);
+}
+void* XML_alloc (size_t n) { return XML_alloc_in(XML_allocator(), n); }
+void* XML_alloc_atomic (size_t n) { return XML_alloc_atomic_in(XML_allocator(), n); }
+XML_Tag* XML_alloc_tag () {
+	const XML_Allocator* a = XML_allocator();
+	if (!a->alloc_tag) return XML_alloc_in(a, sizeof(XML_Tag));
+	XML_STAT_ADD(allocs, 1);
+	XML_STAT_ADD(alloc_bytes, sizeof(XML_Tag));
+	return a->alloc_tag(a->ctx, sizeof(XML_Tag));
+}
+// Gives a tag its extra fields if it doesn't have them yet.  They come from the
+// current allocator, which should be the one the tag came from.
+XML_TagExtra* XML_extra (XML_Tag* t) {
+	if (!t->extra) {
+		t->extra = XML_alloc(sizeof(XML_TagExtra));
+		memset(t->extra, 0, sizeof(XML_TagExtra));
+	}
+	return t->extra;
+}
+const char* XML_tag_ns (const XML_Tag* t) { return t->extra ? t->extra->ns : NULL; }
+const char* XML_tag_local (const XML_Tag* t) { return t->extra && t->extra->local ? t->extra->local : t->name; }
+const char** XML_tag_attr_ns (const XML_Tag* t) { return t->extra ? t->extra->attr_ns : NULL; }
+const char* XML_tag_text (const XML_Tag* t) { return t->extra ? t->extra->text : NULL; }
+void* XML_realloc (void* p, size_t old, size_t n) { return XML_realloc_in(XML_allocator(), p, old, n); }
+void XML_dealloc (void* p) { XML_dealloc_in(XML_allocator(), p); }
+
+// Grows an array by doubling when it's full, so that it can take one more
+void* XML_grow (void* p, uint n, uint* cap, size_t size) {
+	if (n < *cap) return p;
+	uint new_cap = *cap ? *cap * 2 : 4;
+	p = XML_realloc(p, *cap * size, new_cap * size);
+	*cap = new_cap;
+	return p;
+}
+
+
+// A tag starts with is_str = 0, a string with a nonzero character.  Only the
+// first byte is read, since a string might be shorter than a uint.
+uint XML_is_str (XML xml) { return xml.str[0] != 0; }
 uint XML_is_valid (XML xml) { return xml.tag != NULL; }
 
-uint XML_strlen (XML xml) {
+uint XML_escaped_len (const char* s) {
 	uint r = 0;
-	if (XML_is_str(xml)) {
-		uint i;
-		for (i = 0; xml.str[i]; i++) {
-			switch (xml.str[i]) {
-				case '<':
-				case '>': { r += 4; break; }  // &lt; &gt;
-				case '&': { r += 5; break; }  // &amp;
-				case '"': { r += 6; break; }  // &quot;
-				default: { r += 1; break; }
-			}
+	uint i;
+	for (i = 0; s[i]; i++) {
+		switch (s[i]) {
+			case '<':
+			case '>': { r += 4; break; }  // &lt; &gt;
+			case '&': { r += 5; break; }  // &amp;
+			case '"': { r += 6; break; }  // &quot;
+			default: { r += 1; break; }
 		}
-		return r;
 	}
-	else if (xml.tag->n_contents) {  // <tag></tag>
+	return r;
+}
+
+// A tag is marked with XML_CLEAN_TEXT if its own values and text can be
+// copied without escaping.  Its length is cached only if none of the strings
+// under it are borrowed ones that could change without it knowing; trees made
+// with XML_tag are measured again every time unless they're tracked or frozen.
+uint XML_strlen_in (XML_Tag* t, uint trusted) {
+	if (t->len) return t->len;
+	XML_expand((XML)t);
+	trusted = trusted || t->flags & (XML_TRACKED | XML_FROZEN);  // For everything under it
+	uint cache = trusted || t->flags & (XML_OWNS_STRINGS | XML_POOL_STRINGS);
+	uint r = 0;
+	uint clean = 1;
+	uint i;
+	if (t->flags & XML_COMMENT) r = 7 + strlen(t->name);
+	else if (t->flags & XML_PI) {
+		r = 4 + strlen(t->name);
+		if (t->n_contents) r += 1 + strlen(t->contents[0].str);
+	}
+	else if (t->n_contents) {  // <tag></tag>
 		r = 5;
-		r += 2 * strlen(xml.tag->name);
-		uint i;
-		for (i = 0; i < xml.tag->n_contents; i++) {
-			r += XML_strlen(xml.tag->contents[i]);
+		r += 2 * strlen(t->name);
+		for (i = 0; i < t->n_contents; i++) {
+			XML content = t->contents[i];
+			if (XML_is_str(content)) {
+				uint len = XML_escaped_len(content.str);
+				if (len != strlen(content.str)) clean = 0;
+				r += len;
+			}
+			else {
+				r += XML_strlen_in(content.tag, trusted);
+				if (!content.tag->len) cache = 0;
+			}
 		}
 	}
 	else {  // <tag/>
 		r = 3;
-		r += strlen(xml.tag->name);
+		r += strlen(t->name);
 	}
-	uint i;
-	for (i = 0; i < xml.tag->n_attrs; i++) {
+	if (!(t->flags & XML_MISC))
+	for (i = 0; i < t->n_attrs; i++) {
 		r += 4;  // (space)name="value"
-		r += strlen(xml.tag->attrs[i].name);
-		r += XML_strlen((XML)xml.tag->attrs[i].value);
+		r += strlen(t->attrs[i].name);
+		uint len = XML_escaped_len(t->attrs[i].value);
+		if (len != strlen(t->attrs[i].value)) clean = 0;
+		r += len;
 	}
+	if (clean) t->flags |= XML_CLEAN_TEXT;
+	else t->flags &= ~XML_CLEAN_TEXT;
+	if (cache) t->len = r;
 	return r;
 }
+uint XML_strlen (XML xml) {
+	if (XML_is_str(xml)) return XML_escaped_len(xml.str);
+	return XML_strlen_in(xml.tag, 0);
+}
 
-const char* XML_escape (const char* in) {
-	uint len = XML_strlen((XML)in);
+// Writes the escaped form of in to r without a terminator, returns its length
+uint XML_escape_into (char* r, const char* in) {
 	uint i;
 	uint xi;
-	char* r = GC_malloc(len + 1);
 	for (i = 0, xi = 0; in[i]; i++) {
 		switch (in[i]) {
 			case '<': { memcpy(r+xi, "&lt;", 4); xi += 4; break; }
@@ -143,284 +811,2968 @@ const char* XML_escape (const char* in) {
 			default: { r[xi++] = in[i]; break; }
 		}
 	}
-	r[xi] = 0;
+	return xi;
+}
+const char* XML_escape (const char* in) {
+	XML_PHASE_BEGIN(XML_PHASE_ESCAPE);
+	char* r = XML_alloc_atomic(XML_escaped_len(in) + 1);
+	r[XML_escape_into(r, in)] = 0;
+	XML_PHASE_END(XML_PHASE_ESCAPE);
 	return (const char*)r;
 }
 
-const char* XML_unescape (const char* in) {
-	char* r = GC_malloc(strlen(in) + 1);  // We can afford to be sloppy
-	uint i;
-	uint ri;
-	for (i = 0, ri = 0; in[i]; i++, ri++) {
-		r[ri] = in[i];
-		if (in[i] == '&') {
-			if (in[i+1] == 'l') {
-				if (in[i+2] == 't') {
-					if (in[i+3] == ';') {
-						r[ri] = '<'; i += 3;
-					}
-				}
-			}
-			else if (in[i+1] == 'g') {
-				if (in[i+2] == 't') {
-					if (in[i+3] == ';') {
-						r[ri] = '>'; i += 3;
-					}
-				}
-			}
-			else if (in[i+1] == 'a') {
-				if (in[i+2] == 'm') {
-					if (in[i+3] == 'p') {
-						if (in[i+4] == ';') {
-							r[ri] = '&'; i += 4;
-						}
-					}
-				}
-			}
-			else if (in[i+1] == 'q') {
-				if (in[i+2] == 'u') {
-					if (in[i+3] == 'o') {
-						if (in[i+4] == 't') {
-							if (in[i+5] == ';') {
-								r[ri] = '"'; i += 5;
-							}
-						}
-					}
-				}
-			}
+// The entities XML predefines, spelled as they come after the '&'
+const struct { const char* name; uint len; char c; } XML_entities [] = {
+	{"lt;", 3, '<'},
+	{"gt;", 3, '>'},
+	{"amp;", 4, '&'},
+	{"quot;", 5, '"'},
+	{"apos;", 5, '\''}
+};
+// One more than each digit's value, so 0 means it isn't a digit
+const unsigned char XML_digit_values [256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+uint XML_put_utf8 (char* r, unsigned long c) {
+	if (c < 0x80) {
+		r[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		r[0] = 0xC0 | c >> 6;
+		r[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	if (c < 0x10000) {
+		r[0] = 0xE0 | c >> 12;
+		r[1] = 0x80 | (c >> 6 & 0x3F);
+		r[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	r[0] = 0xF0 | c >> 18;
+	r[1] = 0x80 | (c >> 12 & 0x3F);
+	r[2] = 0x80 | (c >> 6 & 0x3F);
+	r[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+// The Char production of XML 1.0
+uint XML_is_xml_char (unsigned long c) {
+	if (c < 0x20) return c == '\t' || c == '\n' || c == '\r';
+	return c <= 0xD7FF || (c >= 0xE000 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0x10FFFF);
+}
+// Decodes the reference starting with the '&' at in, no further than n bytes.
+// Returns how many bytes it took up, or 0 if it isn't a reference we know.
+// What it writes is never longer than what it read.
+uint XML_decode_ref (const char* in, uint n, char* r, uint* rn) {
+	uint i;
+	if (n > 2 && in[1] == '#') {
+		uint base = 10;
+		i = 2;
+		if (in[2] == 'x') {
+			base = 16;
+			i = 3;
+		}
+		uint start = i;
+		while (i < n && in[i] == '0') i++;  // Any number of these, before the limit
+		uint first = i;
+		unsigned long c = 0;
+		for (; i < n && i < first + 8; i++) {
+			uint digit = XML_digit_values[(unsigned char)in[i]];
+			if (!digit || digit > base) break;
+			c = c * base + digit - 1;
 		}
+		if (i == start || i >= n || in[i] != ';') return 0;
+		if (!XML_is_xml_char(c)) return 0;
+		*rn = XML_put_utf8(r, c);
+		return i + 1;
 	}
-	r[ri] = 0;
+	for (i = 0; i < sizeof(XML_entities) / sizeof(XML_entities[0]); i++)
+	if (n > XML_entities[i].len && 0==memcmp(in + 1, XML_entities[i].name, XML_entities[i].len)) {
+		r[0] = XML_entities[i].c;
+		*rn = 1;
+		return XML_entities[i].len + 1;
+	}
+	return 0;
+}
+
+// Decodes n bytes of in into r, which may be in itself, and returns the new
+// length.  Runs without a '&' are found with memchr and copied whole.
+uint XML_unescape_into (char* r, const char* in, uint n) {
+	uint i = 0;
+	uint ri = 0;
+	while (i < n) {
+		const char* amp = memchr(in + i, '&', n - i);
+		uint run = amp ? (uint)(amp - (in + i)) : n - i;
+		if (r + ri != in + i) memmove(r + ri, in + i, run);
+		i += run;
+		ri += run;
+		if (!amp) break;
+		uint rn;
+		uint used = XML_decode_ref(in + i, n - i, r + ri, &rn);
+		if (used) {
+			i += used;
+			ri += rn;
+		}
+		else r[ri++] = in[i++];  // A stray '&' stays as it is
+	}
+	return ri;
+}
+const char* XML_unescape (const char* in) {
+	XML_PHASE_BEGIN(XML_PHASE_UNESCAPE);
+	uint n = strlen(in);
+	char* r = XML_alloc_atomic(n + 1);
+	r[XML_unescape_into(r, in, n)] = 0;
+	XML_PHASE_END(XML_PHASE_UNESCAPE);
 	return (const char*)r;
 }
+// Decodes a string of yours where it is, returning its new length
+uint XML_unescape_in_place (char* s) {
+	XML_PHASE_BEGIN(XML_PHASE_UNESCAPE);
+	uint n = XML_unescape_into(s, s, strlen(s));
+	s[n] = 0;
+	XML_PHASE_END(XML_PHASE_UNESCAPE);
+	return n;
+}
 
-const char* XML_as_text (XML xml) {
-	if (XML_is_str(xml)) {
-		return XML_escape(xml.str);
+uint XML_write_child (char*, XML_Tag*, uint);
+
+// Writes a tag to r without a terminator, after XML_strlen has measured it.
+// A tracked write copies clean children out of earlier renderings.
+// Comments and processing instructions are written as they were read
+uint XML_write_misc (char* r, XML_Tag* t) {
+	uint namelen = strlen(t->name);
+	uint ri = 0;
+	memcpy(r, t->flags & XML_COMMENT ? "<!--" : "<?", t->flags & XML_COMMENT ? 4 : 2);
+	ri += t->flags & XML_COMMENT ? 4 : 2;
+	memcpy(r+ri, t->name, namelen);
+	ri += namelen;
+	if (t->flags & XML_COMMENT) {
+		memcpy(r+ri, "-->", 3);
+		return ri + 3;
 	}
-	else {
-		char* r = GC_malloc(XML_strlen(xml) + 1);
-		uint ri = 0;
-		r[ri++] = '<';
-		uint i;
-		uint namelen = strlen(xml.tag->name);
-		memcpy(r+ri, xml.tag->name, namelen);
-		ri += namelen;
-		for (i = 0; i < xml.tag->n_attrs; i++) {
-			r[ri++] = ' ';
-			uint attrnamelen = strlen(xml.tag->attrs[i].name);
-			memcpy(r+ri, xml.tag->attrs[i].name, attrnamelen);
-			ri += attrnamelen;
-			r[ri++] = '=';
-			r[ri++] = '"';
-			const char* attrvalue = XML_escape(xml.tag->attrs[i].value);
-			uint attrvaluelen = strlen(attrvalue);
-			memcpy(r+ri, attrvalue, attrvaluelen);
+	if (t->n_contents) {
+		uint datalen = strlen(t->contents[0].str);
+		r[ri++] = ' ';
+		memcpy(r+ri, t->contents[0].str, datalen);
+		ri += datalen;
+	}
+	r[ri++] = '?';
+	r[ri++] = '>';
+	return ri;
+}
+uint XML_write_tag (char* r, XML_Tag* t, uint tracked) {
+	if (t->flags & XML_MISC) {
+		if (tracked) t->flags &= ~XML_DIRTY;
+		return XML_write_misc(r, t);
+	}
+	uint clean = t->flags & XML_CLEAN_TEXT;
+	uint ri = 0;
+	r[ri++] = '<';
+	uint i;
+	uint namelen = strlen(t->name);
+	memcpy(r+ri, t->name, namelen);
+	ri += namelen;
+	for (i = 0; i < t->n_attrs; i++) {
+		r[ri++] = ' ';
+		uint attrnamelen = strlen(t->attrs[i].name);
+		memcpy(r+ri, t->attrs[i].name, attrnamelen);
+		ri += attrnamelen;
+		r[ri++] = '=';
+		r[ri++] = '"';
+		if (clean) {
+			uint attrvaluelen = strlen(t->attrs[i].value);
+			memcpy(r+ri, t->attrs[i].value, attrvaluelen);
 			ri += attrvaluelen;
-			r[ri++] = '"';
-		}
-		if (xml.tag->n_contents) {
-			r[ri++] = '>';
-			for (i = 0; i < xml.tag->n_contents; i++) {
-				const char* content = XML_as_text(xml.tag->contents[i]);
-				uint contentlen = strlen(content);
-				memcpy(r+ri, content, contentlen);
+		}
+		else ri += XML_escape_into(r+ri, t->attrs[i].value);
+		r[ri++] = '"';
+	}
+	if (t->n_contents) {
+		r[ri++] = '>';
+		for (i = 0; i < t->n_contents; i++) {
+			XML content = t->contents[i];
+			if (XML_is_str(content) && clean) {
+				uint contentlen = strlen(content.str);
+				memcpy(r+ri, content.str, contentlen);
 				ri += contentlen;
 			}
-			r[ri++] = '<';
-			r[ri++] = '/';
-			memcpy(r+ri, xml.tag->name, namelen);
-			ri += namelen;
-			r[ri++] = '>';
-		}
-		else {
-			r[ri++] = '/';
-			r[ri++] = '>';
+			else if (XML_is_str(content)) ri += XML_escape_into(r+ri, content.str);
+			else if (tracked) ri += XML_write_child(r+ri, content.tag, ri);
+			else ri += XML_write_tag(r+ri, content.tag, 0);
 		}
-		r[ri] = 0;
-		return r;
+		r[ri++] = '<';
+		r[ri++] = '/';
+		memcpy(r+ri, t->name, namelen);
+		ri += namelen;
+		r[ri++] = '>';
+	}
+	else {
+		r[ri++] = '/';
+		r[ri++] = '>';
 	}
+	if (tracked) t->flags &= ~XML_DIRTY;
+	return ri;
+}
+uint XML_write_into (char* r, XML xml) {
+	if (XML_is_str(xml)) return XML_escape_into(r, xml.str);
+	return XML_write_tag(r, xml.tag, 0);
 }
 
+// Finds a clean tag's bytes in the nearest rendering above it, if any
+const char* XML_cached_text (XML_Tag* t) {
+	if (t->flags & XML_DIRTY) return NULL;
+	uint off = 0;
+	for (; t; t = t->parent) {
+		if (!t->extra) return NULL;  // Not rendered since it was made
+		if (t->extra->text) return t->extra->text + off;
+		off += t->extra->text_off;
+	}
+	return NULL;
+}
+// A child's old offset is what its own children are found through, so it
+// changes only once they've been copied.
+uint XML_write_child (char* r, XML_Tag* c, uint off) {
+	if (c->flags & XML_FROZEN) return XML_write_tag(r, c, 0);
+	const char* cached = XML_cached_text(c);
+	uint n;
+	if (cached) {
+		memcpy(r, cached, c->len);
+		n = c->len;
+	}
+	else {
+		n = XML_write_tag(r, c, 1);
+		if (XML_tag_text(c)) {  // Its own rendering is stale now
+			XML_dealloc((void*)c->extra->text);
+			c->extra->text = NULL;
+		}
+	}
+	XML_extra(c)->text_off = off;
+	return n;
+}
+// Makes XML_as_text keep the tree's text, so that after a few changes (see
+// XML_set_attr and friends) only the changed tags are rendered again
+void XML_track (XML xml) {
+	if (XML_is_valid(xml) && !XML_is_str(xml) && !(xml.tag->flags & XML_FROZEN))
+		xml.tag->flags |= XML_TRACKED;
+}
+void XML_write_tracked (char* r, XML_Tag* t) {
+	const char* cached = XML_cached_text(t);
+	if (!cached) {
+		char* text = XML_alloc_atomic(t->len);
+		XML_write_tag(text, t, 1);
+		XML_TagExtra* x = XML_extra(t);
+		if (x->text) XML_dealloc((void*)x->text);
+		x->text = cached = text;
+	}
+	memcpy(r, cached, t->len);
+}
 
-XML XML_tag (const char* name, ...) {
-	va_list args;
-	va_start(args, name);
-	XML_Tag* r = GC_malloc(sizeof(XML_Tag));
-    r->is_str = 0;
-	r->name = name;
-	r->n_attrs = 0;
-    r->attrs = GC_malloc(0);
-    const char* attr_name;
-	while (attr_name = va_arg(args, const char*)) {
-        r->attrs = GC_realloc(r->attrs, (r->n_attrs+1) * sizeof(XML_Attr));
-        r->attrs[r->n_attrs].name = attr_name;
-        if (!(r->attrs[r->n_attrs].value = va_arg(args, const char*))) {
-            fprintf(stderr, "XML error: odd number of strings given in attribute list\n");
-            exit(1);
-        }
-        r->n_attrs++;
-    }
-    r->n_contents = 0;
-    r->contents = GC_malloc(0);
-    XML content;
-	while (content.tag = (XML_Tag*)va_arg(args, void*)) {
-        r->contents = GC_realloc(r->contents, (r->n_contents+1) * sizeof(XML));
-        r->contents[r->n_contents] = content;
-        r->n_contents++;
-    }
-	va_end(args);
-	return (XML)r;
+const char* XML_as_text (XML xml) {
+	XML_PHASE_BEGIN(XML_PHASE_SERIALIZE);
+	uint len = XML_strlen(xml);
+	char* r = XML_alloc_atomic(len + 1);
+	if (!XML_is_str(xml) && (xml.tag->flags & (XML_TRACKED | XML_FROZEN)) == XML_TRACKED)
+		XML_write_tracked(r, xml.tag);
+	else XML_write_into(r, xml);
+	r[len] = 0;
+	XML_PHASE_END(XML_PHASE_SERIALIZE);
+	return r;
 }
 
-const char* XML_get_attr (XML xml, const char* name) {
+
+// Frees a tree made by the parser, XML_tag or XML_TAG with the current
+// allocator (see XML_set_allocator).  Tags own their child tags, but strings
+// given to XML_tag and XML_TAG are borrowed, so those are left alone.  Frozen
+// tags might be shared with other trees, so they're left alone too.
+void XML_free_rest (XML_Tag*);
+void XML_free (XML xml) {
+	if (!XML_is_valid(xml) || XML_is_str(xml)) return;
+	XML_Tag* t = xml.tag;
+	if (t->flags & (XML_IN_ARENA | XML_FROZEN)) return;
 	uint i;
-	for (i = 0; i < xml.tag->n_attrs; i++)
-	if (0==strcmp(xml.tag->attrs[i].name, name))
-		return xml.tag->attrs[i].value;
-	return NULL;
+	for (i = 0; i < t->n_contents; i++) {
+		if (!XML_is_str(t->contents[i])) XML_free(t->contents[i]);
+		else if (t->flags & XML_OWNS_STRINGS) XML_dealloc((void*)t->contents[i].str);
+	}
+	XML_free_rest(t);
 }
-XML XML_get_child (XML xml, const char* name) {
+// Frees a frozen tree that nothing else shares, like one a cache made
+void XML_free_frozen (XML xml) {
+	if (!XML_is_valid(xml) || XML_is_str(xml)) return;
+	XML_Tag* t = xml.tag;
+	if (t->flags & XML_IN_ARENA) return;
 	uint i;
-	for (i = 0; i < xml.tag->n_contents; i++)
-	if (!XML_is_str(xml.tag->contents[i]))
-	if (0==strcmp(xml.tag->contents[i].tag->name, name))
-		return xml.tag->contents[i];
-	return (XML)(XML_Tag*)NULL;
+	for (i = 0; i < t->n_contents; i++) {
+		if (!XML_is_str(t->contents[i])) XML_free_frozen(t->contents[i]);
+		else if (t->flags & XML_OWNS_STRINGS) XML_dealloc((void*)t->contents[i].str);
+	}
+	XML_free_rest(t);
+}
+// Frees everything of a tag's but its contents
+void XML_free_rest (XML_Tag* t) {
+	uint i;
+	if (t->flags & XML_OWNS_STRINGS) {
+		XML_dealloc((void*)t->name);
+		for (i = 0; i < t->n_attrs; i++) {
+			XML_dealloc((void*)t->attrs[i].name);
+			XML_dealloc((void*)t->attrs[i].value);
+		}
+	}
+	if (!(t->flags & XML_ONE_BLOCK)) {
+		XML_dealloc(t->attrs);
+		XML_dealloc(t->contents);
+	}
+	if (t->extra) {
+		if (t->extra->text) XML_dealloc((void*)t->extra->text);
+		if (t->extra->attr_ns) XML_dealloc(t->extra->attr_ns);
+		if (t->extra->index && !t->extra->index_at) XML_index_free((XML_Index*)t->extra->index);
+		XML_dealloc(t->extra);
+	}
+	XML_dealloc(t);
 }
 
-uint XML_isnamechar (char c) {
-	return c && c != '>' && c != '/' && c != '"' && c != '=' && !isspace(c);
+// Lays out a tag with its attribute and content arrays in one block
+size_t XML_tag_block_size (uint n_attrs, uint n_contents) {
+	return sizeof(XML_Tag) + n_attrs * sizeof(XML_Attr) + n_contents * sizeof(XML);
 }
-uint XML_isntnamechar (char c) { return !XML_isnamechar(c); }
-uint XML_isquote (char c) { return c == '"'; }
-uint XML_islt (char c) { return c == '<'; }
-const char* XML_extract_until (const char** pp, uint (* f ) (char)) {
-	uint i = 0;
-	while ((*pp)[i] && !f((*pp)[i])) i++;
-	if (!f((*pp)[i])) return NULL;
-	char* r = GC_malloc(i + 1);
-	memcpy(r, *pp, i);
-	r[i] = 0;
-	*pp += i;
-	return (const char*)r;
+XML_Tag* XML_tag_init (void* block, const char* name, uint n_attrs, uint n_contents) {
+	XML_Tag* r = block;
+	r->is_str = 0;
+	r->flags = XML_ONE_BLOCK | XML_DIRTY;
+	r->len = 0;
+	r->name = name;
+	r->n_attrs = n_attrs;
+	r->attrs = (XML_Attr*)(r + 1);
+	r->n_contents = n_contents;
+	r->contents = (XML*)(r->attrs + n_attrs);
+	r->parent = NULL;
+	r->cap_attrs = n_attrs;
+	r->cap_contents = n_contents;
+	r->hash = 0;
+	r->extra = NULL;
+	return r;
+}
+// Points a new tag's children back at it, except the frozen ones, which can
+// have any number of parents
+void XML_adopt (XML_Tag* t) {
+	uint i;
+	for (i = 0; i < t->n_contents; i++)
+	if (!XML_is_str(t->contents[i]) && !(t->contents[i].tag->flags & XML_FROZEN))
+		t->contents[i].tag->parent = t;
 }
-const char* XML_extract_name (const char** pp) { return XML_extract_until(pp, XML_isntnamechar); }
-void XML_eatws (const char** pp) { while (isspace(**pp)) (*pp)++; }
 
-const char* failp = 0;
-uint failspot = 0;
-XML XML_parse_tag (const char** pp) {
-	const char* p = *pp;
-	if (*p++ != '<') goto ERR_NEW;
-	XML_eatws(&p);
-	if (!*p) goto ERR_NEW;
-	const char* name = XML_extract_name(&p);
-	if (!name || !strlen(name)) goto ERR_NEW;
-	XML_eatws(&p);
+XML XML_tag (const char* name, ...) {
+	va_list args;
+	va_list count;
+	va_start(args, name);
+	va_copy(count, args);
 	uint n_attrs = 0;
-	XML_Attr* attrs = GC_malloc(0);
-	while (XML_isnamechar(*p)) {
-		const char* attrname = XML_extract_name(&p);
-		if (!attrname || !strlen(attrname)) goto ERR_NEW;
-		XML_eatws(&p);
-		if (*p++ != '=') goto ERR_NEW;
-		XML_eatws(&p);
-		if (*p++ != '"') goto ERR_NEW;
-		const char* attrvalesc = XML_extract_until(&p, XML_isquote);
-		if (!attrvalesc) goto ERR_NEW;
-		if (*p++ != '"') goto ERR_NEW;
-		const char* attrval = XML_unescape(attrvalesc);
-		attrs = GC_realloc(attrs, (n_attrs + 1) * sizeof(XML_Attr));
-		attrs[n_attrs].name = attrname;
-		attrs[n_attrs].value = attrval;
+	while (va_arg(count, const char*)) {
+		if (!va_arg(count, const char*)) {
+			fprintf(stderr, "XML error: odd number of strings given in attribute list\n");
+			exit(1);
+		}
 		n_attrs++;
-		XML_eatws(&p);
-		if (!*p) goto ERR_NEW;
 	}
-	if (*p == '/') {
-		p++;
-		XML_eatws(&p);
-		if (*p++ != '>') goto ERR_NEW;
-		XML_Tag* r = GC_malloc(sizeof(XML_Tag));
-		r->is_str = 0;
-		r->name = name;
-		r->n_attrs = n_attrs;
-		r->attrs = attrs;
-		r->n_contents = 0;
-		r->contents = NULL;
-		*pp = p;
-		return (XML)r;
+	uint n_contents = 0;
+	while (va_arg(count, void*)) n_contents++;
+	va_end(count);
+	XML_Tag* r = XML_tag_init(XML_alloc(XML_tag_block_size(n_attrs, n_contents)), name, n_attrs, n_contents);
+	uint i;
+	for (i = 0; i < n_attrs; i++) {
+		r->attrs[i].name = va_arg(args, const char*);
+		r->attrs[i].value = va_arg(args, const char*);
 	}
-	else if (*p == '>') {
-		p++;
-		uint n_contents = 0;
-		XML* contents = GC_malloc(0);
-		if (!*p) goto ERR_NEW;
-		for (;;) {
-			if (*p == '<') {
-				const char* tagp = p;
-				p++;
-				XML_eatws(&p);
-				if (*p == '/') {
-					p++;
-					XML_eatws(&p);
-					uint i;
-					uint namelen = strlen(name);
-					for (i = 0; i < namelen; i++)
-					if (*p++ != name[i])
-						goto ERR_NEW;
-					XML_eatws(&p);
-					if (*p++ != '>') goto ERR_NEW;
-					XML_Tag* r = GC_malloc(sizeof(XML_Tag));
-					r->is_str = 0;
-					r->name = name;
-					r->n_attrs = n_attrs;
-					r->attrs = attrs;
-					r->n_contents = n_contents;
-					r->contents = contents;
-					*pp = p;
-					return (XML)r;
-				}
-				else {
-					p = tagp;
-					XML child = XML_parse_tag(&p);
-					if (!XML_is_valid(child)) goto ERR_PROP;
-					contents = GC_realloc(contents, (n_contents + 1) * sizeof(XML));
-					contents[n_contents] = child;
-					n_contents++;
-				}
-			}
+	va_arg(args, const char*);  // The NULL after the attributes
+	for (i = 0; i < n_contents; i++)
+		r->contents[i].tag = (XML_Tag*)va_arg(args, void*);
+	va_end(args);
+	XML_adopt(r);
+	XML_STAT_ADD(nodes, 1);
+	return (XML)r;
+}
+
+XML XML_tag_n (const char* name, uint n_attr_strs, const char* const* attr_strs, uint n_contents, const XML* contents) {
+	uint n_attrs = n_attr_strs / 2;
+	XML_Tag* r = XML_tag_init(XML_alloc(XML_tag_block_size(n_attrs, n_contents)), name, n_attrs, n_contents);
+	if (n_attrs) memcpy(r->attrs, attr_strs, n_attrs * sizeof(XML_Attr));
+	if (n_contents) memcpy(r->contents, contents, n_contents * sizeof(XML));
+	XML_adopt(r);
+	XML_STAT_ADD(nodes, 1);
+	return (XML)r;
+}
+
+
+typedef struct XML_Writer {
+	char* buf;
+	uint len;
+	uint cap;
+	void (* sink ) (void*, const char*, uint);  // NULL to keep everything in buf
+	void* ctx;
+	const XML_Allocator* alloc;
+	uint in_start;  // The last start tag is still waiting for its '>'
+	uint n_open;
+	uint cap_open;
+	const char** open;
+} XML_Writer;
+
+XML_Writer* XML_writer_new (void (* sink ) (void*, const char*, uint), void* ctx) {
+	const XML_Allocator* a = XML_allocator();
+	XML_Writer* r = XML_alloc_in(a, sizeof(XML_Writer));
+	r->alloc = a;
+	r->cap = 4096;
+	r->buf = XML_alloc_atomic_in(a, r->cap);
+	r->len = 0;
+	r->sink = sink;
+	r->ctx = ctx;
+	r->in_start = 0;
+	r->n_open = 0;
+	r->cap_open = 8;
+	r->open = XML_alloc_in(a, r->cap_open * sizeof(const char*));
+	return r;
+}
+void XML_writer_flush (XML_Writer* w) {
+	if (w->sink && w->len) {
+		w->sink(w->ctx, w->buf, w->len);
+		w->len = 0;
+	}
+}
+char* XML_writer_reserve (XML_Writer* w, uint n) {
+	if (w->len + n + 1 > w->cap) {
+		XML_writer_flush(w);
+		if (w->len + n + 1 > w->cap) {
+			uint old = w->cap;
+			while (w->len + n + 1 > w->cap) w->cap *= 2;
+			w->buf = XML_realloc_in(w->alloc, w->buf, old, w->cap);
+		}
+	}
+	char* r = w->buf + w->len;
+	w->len += n;
+	return r;
+}
+void XML_writer_put (XML_Writer* w, const char* s, uint n) {
+	memcpy(XML_writer_reserve(w, n), s, n);
+}
+void XML_writer_put_escaped (XML_Writer* w, const char* s) {
+	XML_escape_into(XML_writer_reserve(w, XML_escaped_len(s)), s);
+}
+void XML_writer_end_start (XML_Writer* w) {
+	if (w->in_start) {
+		XML_writer_put(w, ">", 1);
+		w->in_start = 0;
+	}
+}
+
+void XML_writer_open (XML_Writer* w, const char* name) {
+	XML_writer_end_start(w);
+	if (w->n_open == w->cap_open) {
+		w->open = XML_realloc_in(w->alloc, w->open, w->cap_open * sizeof(const char*), w->cap_open * 2 * sizeof(const char*));
+		w->cap_open *= 2;
+	}
+	w->open[w->n_open++] = name;
+	XML_writer_put(w, "<", 1);
+	XML_writer_put(w, name, strlen(name));
+	w->in_start = 1;
+}
+void XML_writer_attr (XML_Writer* w, const char* name, const char* value) {
+	assert(w->in_start && "attribute written after the tag's contents");
+	XML_writer_put(w, " ", 1);
+	XML_writer_put(w, name, strlen(name));
+	XML_writer_put(w, "=\"", 2);
+	XML_writer_put_escaped(w, value);
+	XML_writer_put(w, "\"", 1);
+}
+void XML_writer_text (XML_Writer* w, const char* text) {
+	assert(w->n_open && "text written outside of any tag");
+	XML_writer_end_start(w);
+	XML_writer_put_escaped(w, text);
+}
+// name can be NULL; if it isn't, debug builds check that it matches
+void XML_writer_close (XML_Writer* w, const char* name) {
+	assert(w->n_open && "closed more tags than were opened");
+	if (!w->n_open) return;
+	const char* open = w->open[--w->n_open];
+	assert((!name || 0==strcmp(name, open)) && "closed a tag other than the innermost one");
+	if (w->in_start) {
+		XML_writer_put(w, "/>", 2);
+		w->in_start = 0;
+	}
+	else {
+		XML_writer_put(w, "</", 2);
+		XML_writer_put(w, open, strlen(open));
+		XML_writer_put(w, ">", 1);
+	}
+}
+// Gives the text so far (or NULL if there's a sink, after flushing to it)
+const char* XML_writer_finish (XML_Writer* w) {
+	assert(!w->n_open && "finished with tags still open");
+	if (w->sink) {
+		XML_writer_flush(w);
+		return NULL;
+	}
+	w->buf[w->len] = 0;
+	return w->buf;
+}
+// Starts over, reusing the buffer
+void XML_writer_reset (XML_Writer* w) {
+	w->len = 0;
+	w->in_start = 0;
+	w->n_open = 0;
+}
+void XML_writer_free (XML_Writer* w) {
+	XML_dealloc_in(w->alloc, w->buf);
+	XML_dealloc_in(w->alloc, w->open);
+	XML_dealloc_in(w->alloc, w);
+}
+
+
+typedef union XML_Slot {
+	const char* str;
+	long num;
+} XML_Slot;
+
+// Each part is some static text followed by a slot, except the last which
+// has only the static text
+typedef struct XML_TemplatePart {
+	uint off;
+	uint len;
+	char type;  // 't', 'r' or 'i', or 0 for no slot
+	uint slot;
+} XML_TemplatePart;
+
+typedef struct XML_Template {
+	char* text;  // The static text of all the parts
+	uint static_len;
+	uint n_parts;
+	uint cap_parts;
+	XML_TemplatePart* parts;
+	uint n_slots;
+} XML_Template;
+
+const char* XML_intern (const char*, uint);
+// The string an XML_SLOT_* macro stands for.  It's interned, so it lasts as
+// long as the program and can go in trees that outlive the caller.
+const char* XML_slot (char type, uint n) {
+	char s [16];
+	uint len = snprintf(s, sizeof(s), "\x01%c%u", type, n);
+	return XML_intern(s, len);
+}
+uint XML_is_slot (const char* s) {
+	return s[0] == '\x01' && (s[1] == 't' || s[1] == 'r' || s[1] == 'i');
+}
+void XML_template_put (XML_Template* t, uint* cap, const char* s, uint n) {
+	if (t->static_len + n > *cap) {
+		uint old = *cap;
+		while (t->static_len + n > *cap) *cap *= 2;
+		t->text = XML_realloc(t->text, old, *cap);
+	}
+	memcpy(t->text + t->static_len, s, n);
+	t->static_len += n;
+}
+void XML_template_put_escaped (XML_Template* t, uint* cap, const char* s) {
+	const char* escaped = XML_escape(s);
+	XML_template_put(t, cap, escaped, strlen(escaped));
+	XML_dealloc((void*)escaped);
+}
+// Ends the current part with the slot s, or escapes s if it isn't a slot
+void XML_template_string (XML_Template* t, uint* cap, const char* s) {
+	if (!XML_is_slot(s)) {
+		XML_template_put_escaped(t, cap, s);
+		return;
+	}
+	XML_TemplatePart* part = &t->parts[t->n_parts - 1];
+	part->len = t->static_len - part->off;
+	part->type = s[1];
+	part->slot = atoi(s + 2);
+	if (part->slot >= t->n_slots) t->n_slots = part->slot + 1;
+	t->parts = XML_grow(t->parts, t->n_parts, &t->cap_parts, sizeof(XML_TemplatePart));
+	part = &t->parts[t->n_parts++];
+	part->off = t->static_len;
+	part->len = 0;
+	part->type = 0;
+	part->slot = 0;
+}
+void XML_template_walk (XML_Template* t, uint* cap, XML xml) {
+	if (XML_is_str(xml)) {
+		XML_template_string(t, cap, xml.str);
+		return;
+	}
+	if (xml.tag->flags & XML_MISC) {
+		const char* text = XML_as_text(xml);
+		XML_template_put(t, cap, text, strlen(text));
+		XML_dealloc((void*)text);
+		return;
+	}
+	XML_expand(xml);
+	XML_template_put(t, cap, "<", 1);
+	XML_template_put(t, cap, xml.tag->name, strlen(xml.tag->name));
+	uint i;
+	for (i = 0; i < xml.tag->n_attrs; i++) {
+		XML_template_put(t, cap, " ", 1);
+		XML_template_put(t, cap, xml.tag->attrs[i].name, strlen(xml.tag->attrs[i].name));
+		XML_template_put(t, cap, "=\"", 2);
+		XML_template_string(t, cap, xml.tag->attrs[i].value);
+		XML_template_put(t, cap, "\"", 1);
+	}
+	if (xml.tag->n_contents) {
+		XML_template_put(t, cap, ">", 1);
+		for (i = 0; i < xml.tag->n_contents; i++)
+			XML_template_walk(t, cap, xml.tag->contents[i]);
+		XML_template_put(t, cap, "</", 2);
+		XML_template_put(t, cap, xml.tag->name, strlen(xml.tag->name));
+		XML_template_put(t, cap, ">", 1);
+	}
+	else XML_template_put(t, cap, "/>", 2);
+}
+
+// Turns a tree with XML_SLOT_* strings in it into a template, which
+// XML_render can fill in without building or measuring a tree
+XML_Template* XML_compile (XML xml) {
+	XML_Template* t = XML_alloc(sizeof(XML_Template));
+	uint cap = 256;
+	t->text = XML_alloc_atomic(cap);
+	t->static_len = 0;
+	t->n_parts = 1;
+	t->cap_parts = 4;
+	t->parts = XML_alloc(t->cap_parts * sizeof(XML_TemplatePart));
+	t->parts[0].off = 0;
+	t->parts[0].len = 0;
+	t->parts[0].type = 0;
+	t->parts[0].slot = 0;
+	t->n_slots = 0;
+	XML_template_walk(t, &cap, xml);
+	t->parts[t->n_parts - 1].len = t->static_len - t->parts[t->n_parts - 1].off;
+	return t;
+}
+void XML_template_free (XML_Template* t) {
+	XML_dealloc(t->text);
+	XML_dealloc(t->parts);
+	XML_dealloc(t);
+}
+
+uint XML_render_len (const XML_Template* t, const XML_Slot* slots) {
+	uint r = t->static_len;
+	uint i;
+	for (i = 0; i < t->n_parts; i++) {
+		const XML_TemplatePart* part = &t->parts[i];
+		switch (part->type) {
+			case 't': { r += XML_escaped_len(slots[part->slot].str); break; }
+			case 'r': { r += strlen(slots[part->slot].str); break; }
+			case 'i': { r += snprintf(NULL, 0, "%ld", slots[part->slot].num); break; }
+		}
+	}
+	return r;
+}
+// Writes into r, which must have room for XML_render_len bytes, and gives the
+// length written (without a terminator)
+uint XML_render_into (char* r, const XML_Template* t, const XML_Slot* slots) {
+	uint ri = 0;
+	uint i;
+	for (i = 0; i < t->n_parts; i++) {
+		const XML_TemplatePart* part = &t->parts[i];
+		memcpy(r+ri, t->text + part->off, part->len);
+		ri += part->len;
+		switch (part->type) {
+			case 't': { ri += XML_escape_into(r+ri, slots[part->slot].str); break; }
+			case 'r': {
+				uint len = strlen(slots[part->slot].str);
+				memcpy(r+ri, slots[part->slot].str, len);
+				ri += len;
+				break;
+			}
+			case 'i': {
+				char num [24];
+				uint len = snprintf(num, sizeof(num), "%ld", slots[part->slot].num);
+				memcpy(r+ri, num, len);
+				ri += len;
+				break;
+			}
+		}
+	}
+	return ri;
+}
+const char* XML_render (const XML_Template* t, const XML_Slot* slots) {
+	XML_PHASE_BEGIN(XML_PHASE_SERIALIZE);
+	char* r = XML_alloc_atomic(XML_render_len(t, slots) + 1);
+	r[XML_render_into(r, t, slots)] = 0;
+	XML_PHASE_END(XML_PHASE_SERIALIZE);
+	return r;
+}
+
+
+typedef struct XML_BuilderOpen {
+	const char* name;
+	uint attrs_start;
+	uint contents_start;
+} XML_BuilderOpen;
+
+typedef struct XML_Builder {
+	const XML_Allocator* alloc;  // For the builder itself; the tags go in arena
+	XML_Arena* arena;
+	uint n_open;
+	uint cap_open;
+	XML_BuilderOpen* open;
+	uint n_attrs;
+	uint cap_attrs;
+	XML_Attr* attrs;
+	uint n_contents;
+	uint cap_contents;
+	XML* contents;
+} XML_Builder;
+
+XML_Builder* XML_builder_new () {
+	const XML_Allocator* a = XML_allocator();
+	XML_Builder* r = XML_alloc_in(a, sizeof(XML_Builder));
+	r->alloc = a;
+	r->arena = XML_arena_new();
+	r->n_open = 0;
+	r->cap_open = 8;
+	r->open = XML_alloc_in(a, r->cap_open * sizeof(XML_BuilderOpen));
+	r->n_attrs = 0;
+	r->cap_attrs = 16;
+	r->attrs = XML_alloc_in(a, r->cap_attrs * sizeof(XML_Attr));
+	r->n_contents = 0;
+	r->cap_contents = 16;
+	r->contents = XML_alloc_in(a, r->cap_contents * sizeof(XML));
+	return r;
+}
+
+// Drops everything built so far but keeps the memory for the next tree
+void XML_builder_reset (XML_Builder* b) {
+	XML_arena_reset(b->arena);
+	b->n_open = 0;
+	b->n_attrs = 0;
+	b->n_contents = 0;
+}
+void XML_builder_free (XML_Builder* b) {
+	XML_arena_destroy(b->arena);
+	XML_dealloc_in(b->alloc, b->open);
+	XML_dealloc_in(b->alloc, b->attrs);
+	XML_dealloc_in(b->alloc, b->contents);
+	XML_dealloc_in(b->alloc, b);
+}
+
+void XML_builder_begin (XML_Builder* b, const char* name) {
+	if (b->n_open == b->cap_open) {
+		b->open = XML_realloc_in(b->alloc, b->open, b->cap_open * sizeof(XML_BuilderOpen), b->cap_open * 2 * sizeof(XML_BuilderOpen));
+		b->cap_open *= 2;
+	}
+	b->open[b->n_open].name = name;
+	b->open[b->n_open].attrs_start = b->n_attrs;
+	b->open[b->n_open].contents_start = b->n_contents;
+	b->n_open++;
+}
+void XML_builder_attr (XML_Builder* b, const char* name, const char* value) {
+	if (b->n_attrs == b->cap_attrs) {
+		b->attrs = XML_realloc_in(b->alloc, b->attrs, b->cap_attrs * sizeof(XML_Attr), b->cap_attrs * 2 * sizeof(XML_Attr));
+		b->cap_attrs *= 2;
+	}
+	b->attrs[b->n_attrs].name = name;
+	b->attrs[b->n_attrs].value = value;
+	b->n_attrs++;
+}
+void XML_builder_add (XML_Builder* b, XML content) {
+	if (b->n_contents == b->cap_contents) {
+		b->contents = XML_realloc_in(b->alloc, b->contents, b->cap_contents * sizeof(XML), b->cap_contents * 2 * sizeof(XML));
+		b->cap_contents *= 2;
+	}
+	b->contents[b->n_contents++] = content;
+}
+void XML_builder_text (XML_Builder* b, const char* text) { XML_builder_add(b, (XML)text); }
+XML XML_builder_end (XML_Builder* b) {
+	if (!b->n_open) return (XML)(XML_Tag*)NULL;
+	XML_BuilderOpen* o = &b->open[--b->n_open];
+	uint n_attrs = b->n_attrs - o->attrs_start;
+	uint n_contents = b->n_contents - o->contents_start;
+	XML_Tag* r = XML_tag_init(XML_arena_alloc(b->arena, XML_tag_block_size(n_attrs, n_contents)), o->name, n_attrs, n_contents);
+	r->flags |= XML_IN_ARENA;
+	memcpy(r->attrs, b->attrs + o->attrs_start, n_attrs * sizeof(XML_Attr));
+	memcpy(r->contents, b->contents + o->contents_start, n_contents * sizeof(XML));
+	XML_adopt(r);
+	b->n_attrs = o->attrs_start;
+	b->n_contents = o->contents_start;
+	if (b->n_open) XML_builder_add(b, (XML)r);
+	XML_STAT_ADD(nodes, 1);
+	return (XML)r;
+}
+
+const char* XML_get_attr (XML xml, const char* name) {
+	XML_expand(xml);
+	uint i;
+	for (i = 0; i < xml.tag->n_attrs; i++)
+	if (0==strcmp(xml.tag->attrs[i].name, name))
+		return xml.tag->attrs[i].value;
+	return NULL;
+}
+XML XML_get_child (XML xml, const char* name) {
+	XML_expand(xml);
+	uint i;
+	for (i = 0; i < xml.tag->n_contents; i++)
+	if (!XML_is_str(xml.tag->contents[i]) && !(xml.tag->contents[i].tag->flags & XML_MISC))
+	if (0==strcmp(xml.tag->contents[i].tag->name, name))
+		return xml.tag->contents[i];
+	return (XML)(XML_Tag*)NULL;
+}
+
+// Marks a tag and its ancestors as changed, so that they're measured and hashed again
+// and a tracked XML_as_text renders them instead of copying their old text
+void XML_touch (XML_Tag* t) {
+	for (; t && (!(t->flags & XML_DIRTY) || t->len || t->hash); t = t->parent) {
+		t->flags = (t->flags | XML_DIRTY) & ~XML_CLEAN_TEXT;
+		t->len = 0;
+		t->hash = 0;
+	}
+}
+// Strings given to the setters are copied into tags that own their strings
+// and borrowed by the rest, same as when the tag was made
+const char* XML_own (XML_Tag* t, const char* s) {
+	if (!(t->flags & XML_OWNS_STRINGS)) {
+		t->flags &= ~XML_POOL_STRINGS;
+		return s;
+	}
+	uint n = strlen(s) + 1;
+	char* r = XML_alloc_atomic(n);
+	memcpy(r, s, n);
+	return r;
+}
+void XML_drop (XML_Tag* t, XML content) {
+	if (!XML_is_str(content)) {
+		if (!(content.tag->flags & XML_FROZEN)) content.tag->parent = NULL;
+		XML_free(content);
+	}
+	else if (t->flags & XML_OWNS_STRINGS) XML_dealloc((void*)content.str);
+}
+// Moves a tag's arrays out of its block the first time it has to grow
+void XML_unblock (XML_Tag* t) {
+	if (!(t->flags & XML_ONE_BLOCK)) return;
+	XML_Attr* attrs = NULL;
+	XML* contents = NULL;
+	if (t->cap_attrs) {
+		attrs = XML_alloc(t->cap_attrs * sizeof(XML_Attr));
+		memcpy(attrs, t->attrs, t->n_attrs * sizeof(XML_Attr));
+	}
+	if (t->cap_contents) {
+		contents = XML_alloc(t->cap_contents * sizeof(XML));
+		memcpy(contents, t->contents, t->n_contents * sizeof(XML));
+	}
+	t->attrs = attrs;
+	t->contents = contents;
+	t->flags &= ~XML_ONE_BLOCK;
+}
+
+// Lazy tags are made whole first, since every caller goes on to change them.
+// A builder's tags can't grow, since anything they'd get from the current
+// allocator would never be freed along with the arena.
+uint XML_is_mutable (XML xml) {
+	if (!XML_is_valid(xml) || XML_is_str(xml) || xml.tag->flags & (XML_FROZEN | XML_IN_ARENA)) return 0;
+	XML_expand(xml);
+	return 1;
+}
+
+const char* XML_tag_lookup_ns (const XML_Tag*, const char*, uint);
+// These return 0 and change nothing if they can't do what's asked
+uint XML_set_attr (XML xml, const char* name, const char* value) {
+	if (!XML_is_mutable(xml)) return 0;
+	XML_Tag* t = xml.tag;
+	uint i;
+	for (i = 0; i < t->n_attrs; i++)
+	if (0==strcmp(t->attrs[i].name, name)) {
+		if (0==strcmp(t->attrs[i].value, value)) return 1;
+		const char* old = t->attrs[i].value;
+		t->attrs[i].value = XML_own(t, value);
+		if (t->flags & XML_OWNS_STRINGS) XML_dealloc((void*)old);
+		XML_touch(t);
+		return 1;
+	}
+	if (t->n_attrs == t->cap_attrs) XML_unblock(t);
+	uint old_cap = t->cap_attrs;
+	t->attrs = XML_grow(t->attrs, t->n_attrs, &t->cap_attrs, sizeof(XML_Attr));
+	if (XML_tag_attr_ns(t)) {
+		if (t->cap_attrs != old_cap)
+			t->extra->attr_ns = XML_realloc(t->extra->attr_ns, old_cap * sizeof(const char*), t->cap_attrs * sizeof(const char*));
+		t->extra->attr_ns[t->n_attrs] = NULL;
+	}
+	const char* colon = strchr(name, ':');
+	const char* ns = colon ? XML_tag_lookup_ns(t, name, colon - name) : NULL;
+	if (ns) {
+		XML_TagExtra* x = XML_extra(t);
+		if (!x->attr_ns) {
+			x->attr_ns = XML_alloc(t->cap_attrs * sizeof(const char*));
+			memset(x->attr_ns, 0, t->cap_attrs * sizeof(const char*));
+		}
+		x->attr_ns[t->n_attrs] = ns;
+	}
+	t->attrs[t->n_attrs].name = XML_own(t, name);
+	t->attrs[t->n_attrs].value = XML_own(t, value);
+	t->n_attrs++;
+	XML_touch(t);
+	return 1;
+}
+// The tree takes over a child tag, which can't already be in another tree
+uint XML_insert_child (XML xml, uint i, XML child) {
+	if (!XML_is_mutable(xml) || !XML_is_valid(child)) return 0;
+	XML_Tag* t = xml.tag;
+	if (i > t->n_contents) return 0;
+	uint frozen = !XML_is_str(child) && child.tag->flags & XML_FROZEN;
+	if (!XML_is_str(child) && !frozen && (child.tag->parent || child.tag == t)) return 0;
+	if (t->n_contents == t->cap_contents) XML_unblock(t);
+	t->contents = XML_grow(t->contents, t->n_contents, &t->cap_contents, sizeof(XML));
+	memmove(t->contents + i + 1, t->contents + i, (t->n_contents - i) * sizeof(XML));
+	if (XML_is_str(child)) child.str = XML_own(t, child.str);
+	else if (!frozen) child.tag->parent = t;
+	t->contents[i] = child;
+	t->n_contents++;
+	XML_touch(t);
+	return 1;
+}
+uint XML_append_child (XML xml, XML child) {
+	if (!XML_is_mutable(xml)) return 0;
+	return XML_insert_child(xml, xml.tag->n_contents, child);
+}
+// Frees the child, along with its text if the tag owns its strings
+uint XML_remove_child (XML xml, uint i) {
+	if (!XML_is_mutable(xml)) return 0;
+	XML_Tag* t = xml.tag;
+	if (i >= t->n_contents) return 0;
+	XML_drop(t, t->contents[i]);
+	memmove(t->contents + i, t->contents + i + 1, (t->n_contents - i - 1) * sizeof(XML));
+	t->n_contents--;
+	XML_touch(t);
+	return 1;
+}
+// Replaces all of a tag's contents with one string, or none if it's empty
+uint XML_set_text (XML xml, const char* text) {
+	if (!XML_is_mutable(xml)) return 0;
+	XML_Tag* t = xml.tag;
+	uint i;
+	for (i = 0; i < t->n_contents; i++) XML_drop(t, t->contents[i]);
+	t->n_contents = 0;
+	XML_touch(t);
+	if (text[0]) return XML_insert_child(xml, 0, (XML)text);
+	return 1;
+}
+
+// Measures a tree and marks it frozen, after which it's only ever read, so
+// any number of threads can share it without locking
+XML XML_freeze (XML xml) {
+	if (!XML_is_valid(xml) || XML_is_str(xml) || xml.tag->flags & XML_FROZEN) return xml;
+	XML_expand(xml);
+	uint i;
+	for (i = 0; i < xml.tag->n_contents; i++) XML_freeze(xml.tag->contents[i]);
+	xml.tag->flags |= XML_FROZEN;
+	XML_strlen(xml);
+	XML_hash(xml);
+	return xml;
+}
+// The XML_with functions give a frozen copy of one tag with one thing changed.
+// The copy borrows everything else from the original, whose children are
+// frozen if they weren't already, since now they have two parents.
+XML_Tag* XML_copy_tag (XML_Tag* t, uint n_attrs, uint n_contents) {
+	XML_expand((XML)t);
+	XML_Tag* r = XML_tag_init(XML_alloc(XML_tag_block_size(n_attrs, n_contents)), t->name, n_attrs, n_contents);
+	uint na = n_attrs < t->n_attrs ? n_attrs : t->n_attrs;
+	uint nc = n_contents < t->n_contents ? n_contents : t->n_contents;
+	if (na) memcpy(r->attrs, t->attrs, na * sizeof(XML_Attr));
+	if (nc) memcpy(r->contents, t->contents, nc * sizeof(XML));
+	if (XML_tag_ns(t) || XML_tag_local(t) != t->name || XML_tag_attr_ns(t)) {
+		XML_TagExtra* x = XML_extra(r);
+		x->ns = t->extra->ns;
+		x->local = t->extra->local;
+		if (t->extra->attr_ns) {
+			x->attr_ns = XML_alloc(n_attrs * sizeof(const char*));
+			memset(x->attr_ns, 0, n_attrs * sizeof(const char*));
+			if (na) memcpy(x->attr_ns, t->extra->attr_ns, na * sizeof(const char*));
+		}
+	}
+	XML_STAT_ADD(nodes, 1);
+	return r;
+}
+XML XML_with_attr (XML xml, const char* name, const char* value) {
+	if (!XML_is_valid(xml) || XML_is_str(xml)) return (XML)(XML_Tag*)NULL;
+	XML_expand(xml);
+	XML_Tag* t = xml.tag;
+	uint i;
+	for (i = 0; i < t->n_attrs; i++)
+	if (0==strcmp(t->attrs[i].name, name))
+		break;
+	XML_Tag* r = XML_copy_tag(t, i < t->n_attrs ? t->n_attrs : t->n_attrs + 1, t->n_contents);
+	r->attrs[i].name = name;
+	r->attrs[i].value = value;
+	return XML_freeze((XML)r);
+}
+XML XML_with_child (XML xml, uint i, XML child) {
+	if (!XML_is_valid(xml) || XML_is_str(xml) || !XML_is_valid(child)) return (XML)(XML_Tag*)NULL;
+	XML_expand(xml);
+	if (i >= xml.tag->n_contents) return (XML)(XML_Tag*)NULL;
+	XML_Tag* r = XML_copy_tag(xml.tag, xml.tag->n_attrs, xml.tag->n_contents);
+	r->contents[i] = child;
+	return XML_freeze((XML)r);
+}
+XML XML_appended (XML xml, XML child) {
+	if (!XML_is_valid(xml) || XML_is_str(xml) || !XML_is_valid(child)) return (XML)(XML_Tag*)NULL;
+	XML_expand(xml);
+	XML_Tag* r = XML_copy_tag(xml.tag, xml.tag->n_attrs, xml.tag->n_contents + 1);
+	r->contents[xml.tag->n_contents] = child;
+	return XML_freeze((XML)r);
+}
+XML XML_without_child (XML xml, uint i) {
+	XML_expand(xml);
+	if (!XML_is_valid(xml) || XML_is_str(xml) || i >= xml.tag->n_contents) return (XML)(XML_Tag*)NULL;
+	XML_Tag* r = XML_copy_tag(xml.tag, xml.tag->n_attrs, xml.tag->n_contents - 1);
+	memcpy(r->contents + i, xml.tag->contents + i + 1, (xml.tag->n_contents - i - 1) * sizeof(XML));
+	return XML_freeze((XML)r);
+}
+
+// A path is the index into contents at each level down from the root
+XML XML_at (XML root, const uint* path, uint depth) {
+	uint i;
+	for (i = 0; i < depth; i++) {
+		XML_expand(root);
+		if (!XML_is_valid(root) || XML_is_str(root) || path[i] >= root.tag->n_contents)
+			return (XML)(XML_Tag*)NULL;
+		root = root.tag->contents[path[i]];
+	}
+	return root;
+}
+// Gives a new version of root with the node at path replaced, copying only
+// the tags on the way down to it.  The old version stays as it was.
+XML XML_update (XML root, const uint* path, uint depth, XML replacement) {
+	if (!depth) return XML_freeze(replacement);
+	XML_expand(root);
+	if (!XML_is_valid(root) || XML_is_str(root) || path[0] >= root.tag->n_contents)
+		return (XML)(XML_Tag*)NULL;
+	XML child = XML_update(root.tag->contents[path[0]], path + 1, depth - 1, replacement);
+	if (!XML_is_valid(child)) return child;
+	return XML_with_child(root, path[0], child);
+}
+
+uint XML_isnamechar (char c) {
+	return c && c != '>' && c != '/' && c != '"' && c != '=' && !isspace(c);
+}
+uint XML_isntnamechar (char c) { return !XML_isnamechar(c); }
+uint XML_isquote (char c) { return c == '"'; }
+// Gives how far p goes before f is true, or -1 if the string ends first
+int XML_scan_until (const char* p, uint (* f ) (char)) {
+	uint i = 0;
+	while (p[i] && !f(p[i])) i++;
+	return f(p[i]) ? (int)i : -1;
+}
+const char* XML_extract_until (const char** pp, uint (* f ) (char)) {
+	int n = XML_scan_until(*pp, f);
+	if (n < 0) return NULL;
+	char* r = XML_alloc_atomic(n + 1);
+	memcpy(r, *pp, n);
+	r[n] = 0;
+	*pp += n;
+	return (const char*)r;
+}
+const char* XML_unescape_run (const char* start, uint n) {
+	char* r = XML_alloc_atomic(n + 1);
+	r[XML_unescape_into(r, start, n)] = 0;
+	return (const char*)r;
+}
+const char* XML_extract_name (const char** pp) { return XML_extract_until(pp, XML_isntnamechar); }
+
+// The parser finds the end of each run with XML_scan_to.  Given an XML_Scan,
+// that works in two stages.  First each 64-byte block of the input is turned
+// into a bitmap of where the characters that could end the run are, with bit
+// i for byte i.  Then the run's end is found by counting zero bits.  A block's
+// bitmaps are only made when they're first needed and are kept until the scan
+// moves past the block, so a short name and the next few after it share them.
+enum {
+	XML_TO_LT,  // The end of text
+	XML_TO_QUOTE,  // The end of an attribute value
+	XML_TO_NAME_END,  // Whitespace, '>', '/', '"' or '='
+	XML_N_SCAN_CLASSES
+};
+
+typedef struct XML_Scan {
+	const char* src;
+	const char* end;  // Its terminating NUL
+	const char* block;  // Where the block the bitmaps are for starts
+	uint have;  // Which classes have bitmaps for this block
+	uint64_t bits [XML_N_SCAN_CLASSES];
+	unsigned char tail [64];  // The last block, padded with NULs
+} XML_Scan;
+
+void XML_scan_init (XML_Scan* sc, const char* src, const char* end) {
+	sc->src = src;
+	sc->end = end;
+	sc->block = NULL;
+	sc->have = 0;
+}
+
+// Which bytes of a block are c, and which are whitespace (as isspace sees it)
+#ifdef __SSE2__
+uint64_t XML_block_eq (const unsigned char* b, unsigned char c) {
+	__m128i v = _mm_set1_epi8(c);
+	uint64_t r = 0;
+	uint i;
+	for (i = 0; i < 4; i++) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(b + 16*i));
+		r |= (uint64_t)(uint)_mm_movemask_epi8(_mm_cmpeq_epi8(x, v)) << 16*i;
+	}
+	return r;
+}
+uint64_t XML_block_space (const unsigned char* b) {
+	uint64_t r = 0;
+	uint i;
+	for (i = 0; i < 4; i++) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(b + 16*i));
+		__m128i ctl = _mm_sub_epi8(x, _mm_set1_epi8('\t'));  // \t through \r become 0 to 4
+		__m128i hit = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl),
+			_mm_cmpeq_epi8(x, _mm_set1_epi8(' '))
+		);
+		r |= (uint64_t)(uint)_mm_movemask_epi8(hit) << 16*i;
+	}
+	return r;
+}
+#else
+// Packs the high bit of each byte of a word into a byte
+uint64_t XML_word_bits (uint64_t high) {
+	return ((high >> 7) * 0x0102040810204080ull) >> 56;
+}
+uint64_t XML_block_eq (const unsigned char* b, unsigned char c) {
+	uint64_t r = 0;
+	uint i;
+	for (i = 0; i < 8; i++) {
+		uint64_t w;
+		memcpy(&w, b + 8*i, 8);
+		uint64_t x = w ^ (0x0101010101010101ull * c);
+		// The high bit is set in each byte of x that's zero
+		uint64_t zero = ~(((x & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | x) & 0x8080808080808080ull;
+		r |= XML_word_bits(zero) << 8*i;
+	}
+	return r;
+}
+uint64_t XML_block_space (const unsigned char* b) {
+	uint64_t r = XML_block_eq(b, ' ');
+	uint i;
+	for (i = 0; i < 8; i++) {
+		uint64_t w;
+		memcpy(&w, b + 8*i, 8);
+		uint64_t low = w & 0x7F7F7F7F7F7F7F7Full;
+		// At least \t, but not past \r, and not above 0x7F
+		uint64_t ctl = (low + 0x7777777777777777ull) & ~(low + 0x7272727272727272ull) & ~w & 0x8080808080808080ull;
+		r |= XML_word_bits(ctl) << 8*i;
+	}
+	return r;
+}
+#endif
+
+void XML_scan_classify (XML_Scan* sc, uint cls) {
+	const unsigned char* b = (const unsigned char*)sc->block;
+	if (sc->block + 64 > sc->end) {
+		memcpy(sc->tail, b, sc->end - sc->block);
+		memset(sc->tail + (sc->end - sc->block), 0, 64 - (sc->end - sc->block));
+		b = sc->tail;
+	}
+	switch (cls) {
+		case XML_TO_LT: { sc->bits[cls] = XML_block_eq(b, '<'); break; }
+		case XML_TO_QUOTE: { sc->bits[cls] = XML_block_eq(b, '"'); break; }
+		case XML_TO_NAME_END: {
+			sc->bits[cls] = XML_block_space(b) | XML_block_eq(b, '>') | XML_block_eq(b, '/')
+				| XML_block_eq(b, '"') | XML_block_eq(b, '=');
+			break;
+		}
+	}
+	sc->have |= 1 << cls;
+}
+// Gives the first character at or after p that ends a run of the class, or
+// the terminating NUL.  Without an XML_Scan it looks at one byte at a time.
+const char* XML_scan_to (XML_Scan* sc, const char* p, uint cls) {
+	if (!sc) {
+		switch (cls) {
+			case XML_TO_LT: { while (*p && *p != '<') p++; break; }
+			case XML_TO_QUOTE: { while (*p && *p != '"') p++; break; }
+			case XML_TO_NAME_END: { while (XML_isnamechar(*p)) p++; break; }
+		}
+		return p;
+	}
+	for (;;) {
+		if (p >= sc->end) return sc->end;
+		const char* block = sc->src + ((p - sc->src) & ~(size_t)63);
+		if (block != sc->block) {
+			sc->block = block;
+			sc->have = 0;
+		}
+		if (!(sc->have & 1 << cls)) XML_scan_classify(sc, cls);
+		uint64_t m = sc->bits[cls] & ~0ull << (p - block);
+		if (m) return block + __builtin_ctzll(m);
+		p = block + 64;
+	}
+}
+void XML_eatws (const char** pp) { while (isspace(**pp)) (*pp)++; }
+
+const char* failp = 0;
+uint failspot = 0;
+uint endspot = 0;  // How much of its input the last XML_parse_opts read
+
+// Namespace URIs are interned, so that they can be compared by pointer.  The
+// table is shared by all threads and never shrinks.
+const char** XML_atoms = NULL;
+uint XML_n_atoms = 0;
+uint XML_cap_atoms = 0;
+pthread_mutex_t XML_atoms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* XML_intern (const char* s, uint n) {
+	pthread_mutex_lock(&XML_atoms_lock);
+	if (2 * (XML_n_atoms + 1) > XML_cap_atoms) {
+		uint old_cap = XML_cap_atoms;
+		const char** old = XML_atoms;
+		XML_cap_atoms = old_cap ? old_cap * 2 : 64;
+		XML_atoms = XML_sys_alloc(XML_cap_atoms * sizeof(const char*));
+		memset(XML_atoms, 0, XML_cap_atoms * sizeof(const char*));
+		uint i;
+		for (i = 0; i < old_cap; i++)
+		if (old[i]) {
+			uint j = XML_hash_bytes(old[i], strlen(old[i])) & (XML_cap_atoms - 1);
+			while (XML_atoms[j]) j = (j + 1) & (XML_cap_atoms - 1);
+			XML_atoms[j] = old[i];
+		}
+		XML_sys_free(old);
+	}
+	uint j = XML_hash_bytes(s, n) & (XML_cap_atoms - 1);
+	while (XML_atoms[j] && !(0==strncmp(XML_atoms[j], s, n) && !XML_atoms[j][n]))
+		j = (j + 1) & (XML_cap_atoms - 1);
+	if (!XML_atoms[j]) {
+		char* atom = XML_sys_alloc(n + 1);
+		memcpy(atom, s, n);
+		atom[n] = 0;
+		XML_atoms[j] = atom;
+		XML_n_atoms++;
+	}
+	const char* r = XML_atoms[j];
+	pthread_mutex_unlock(&XML_atoms_lock);
+	return r;
+}
+// The atom for a namespace URI, to give to XML_get_child_ns and XML_get_attr_ns
+const char* XML_ns (const char* uri) { return XML_intern(uri, strlen(uri)); }
+
+XML XML_get_child_ns (XML xml, const char* ns, const char* local) {
+	XML_expand(xml);
+	uint i;
+	for (i = 0; i < xml.tag->n_contents; i++) {
+		XML c = xml.tag->contents[i];
+		if (!XML_is_str(c) && !(c.tag->flags & XML_MISC) && XML_tag_ns(c.tag) == ns && 0==strcmp(XML_tag_local(c.tag), local))
+			return c;
+	}
+	return (XML)(XML_Tag*)NULL;
+}
+// Attributes without a prefix have no namespace
+const char* XML_get_attr_ns (XML xml, const char* ns, const char* local) {
+	XML_expand(xml);
+	uint i;
+	for (i = 0; i < xml.tag->n_attrs; i++) {
+		const char** attr_ns = XML_tag_attr_ns(xml.tag);
+		if ((attr_ns ? attr_ns[i] : NULL) != ns) continue;
+		const char* name = xml.tag->attrs[i].name;
+		const char* colon = ns ? strchr(name, ':') : NULL;
+		if (0==strcmp(colon ? colon + 1 : name, local)) return xml.tag->attrs[i].value;
+	}
+	return NULL;
+}
+
+// A string pool keeps every string the parser makes in one arena, and gives
+// out one copy of each that's shorter than max_len.  Unlike namespace atoms,
+// a pool belongs to whoever made it and isn't locked.
+struct XML_StrPool {
+	const XML_Allocator* alloc;  // For the table; the strings go in arena
+	XML_Arena* arena;
+	uint max_len;
+	uint n;
+	uint cap;  // A power of two
+	const char** slots;
+	unsigned long hits;  // How many strings were found already there
+	size_t bytes;  // Taken up by the strings in the pool
+	size_t saved;  // Not taken up, thanks to the hits
+};
+
+XML_StrPool* XML_pool_new (uint max_len) {
+	const XML_Allocator* a = XML_allocator();
+	XML_StrPool* r = XML_alloc_in(a, sizeof(XML_StrPool));
+	r->alloc = a;
+	r->arena = XML_arena_new();
+	r->max_len = max_len;
+	r->n = 0;
+	r->cap = 256;
+	r->slots = XML_alloc_in(a, r->cap * sizeof(const char*));
+	memset(r->slots, 0, r->cap * sizeof(const char*));
+	r->hits = 0;
+	r->bytes = 0;
+	r->saved = 0;
+	return r;
+}
+// Drops every string in the pool, and so every tree parsed with it, but keeps
+// the memory for the next document
+void XML_pool_reset (XML_StrPool* sp) {
+	XML_arena_reset(sp->arena);
+	memset(sp->slots, 0, sp->cap * sizeof(const char*));
+	sp->n = 0;
+	sp->hits = 0;
+	sp->bytes = 0;
+	sp->saved = 0;
+}
+void XML_pool_free (XML_StrPool* sp) {
+	XML_arena_destroy(sp->arena);
+	XML_dealloc_in(sp->alloc, sp->slots);
+	XML_dealloc_in(sp->alloc, sp);
+}
+void XML_pool_grow (XML_StrPool* sp) {
+	uint old_cap = sp->cap;
+	const char** old = sp->slots;
+	sp->cap *= 2;
+	sp->slots = XML_alloc_in(sp->alloc, sp->cap * sizeof(const char*));
+	memset(sp->slots, 0, sp->cap * sizeof(const char*));
+	uint i;
+	for (i = 0; i < old_cap; i++)
+	if (old[i]) {
+		uint j = XML_hash_bytes(old[i], strlen(old[i])) & (sp->cap - 1);
+		while (sp->slots[j]) j = (j + 1) & (sp->cap - 1);
+		sp->slots[j] = old[i];
+	}
+	XML_dealloc_in(sp->alloc, old);
+}
+// Copies n bytes of input into the pool, decoding them first if unescape is
+// set.  The copy is made at the end of the arena, and given back if an equal
+// string is already there.
+const char* XML_pool_run (XML_StrPool* sp, const char* start, uint n, uint unescape) {
+	char* r = XML_arena_alloc(sp->arena, n + 1);
+	uint len = n;
+	if (unescape) len = XML_unescape_into(r, start, n);
+	else memcpy(r, start, n);
+	r[len] = 0;
+	if (len < sp->max_len) {
+		if (2 * (sp->n + 1) > sp->cap) XML_pool_grow(sp);
+		uint j = XML_hash_bytes(r, len) & (sp->cap - 1);
+		for (; sp->slots[j]; j = (j + 1) & (sp->cap - 1))
+		if (0==strcmp(sp->slots[j], r)) {
+			XML_arena_realloc(sp->arena, r, n + 1, 0);
+			sp->hits++;
+			sp->saved += len + 1;
+			return sp->slots[j];
+		}
+		sp->slots[j] = r;
+		sp->n++;
+	}
+	XML_arena_realloc(sp->arena, r, n + 1, len + 1);
+	sp->bytes += len + 1;
+	return r;
+}
+const char* XML_pool_str (XML_StrPool* sp, const char* s) {
+	return XML_pool_run(sp, s, strlen(s), 0);
+}
+
+typedef struct XML_NsBinding {
+	const char* prefix;  // Not terminated
+	uint len;
+	const char* ns;
+} XML_NsBinding;
+
+// What the parser carries down through the tree
+typedef struct XML_ParseState {
+	const XML_ParseOptions* o;
+	XML_Scan* scan;
+	uint depth;  // Of the next tag, with the root at 0
+	uint64_t alive;  // The paths the next tag's parent is on
+	uint within;  // Whether the next tag is under an included tag or the end of a path
+	uint64_t found;  // The paths whose last tag has been read
+	uint64_t all;  // Every path
+	uint stopped;  // Once they all have
+	uint empty;  // Set when a tag is done if it was only kept for what was in it, and nothing was
+	uint n_bindings;
+	uint cap_bindings;
+	XML_NsBinding* bindings;
+} XML_ParseState;
+
+const char XML_unbound [] = "";
+const char* XML_lookup_ns (XML_ParseState* s, const char* prefix, uint len) {
+	uint i;
+	for (i = s->n_bindings; i--;)
+	if (s->bindings[i].len == len && 0==memcmp(s->bindings[i].prefix, prefix, len))
+		return s->bindings[i].ns;
+	if (len == 0) return NULL;
+	if (len == 3 && 0==memcmp(prefix, "xml", 3)) return XML_ns("http://www.w3.org/XML/1998/namespace");
+	if (len == 5 && 0==memcmp(prefix, "xmlns", 5)) return XML_ns("http://www.w3.org/2000/xmlns/");
+	return XML_unbound;
+}
+// The same for a tree that's already been made, through the xmlns attributes
+// on a tag and the tags above it.  An unbound prefix gives NULL.
+const char* XML_tag_lookup_ns (const XML_Tag* t, const char* prefix, uint len) {
+	for (; t; t = t->parent) {
+		uint i;
+		for (i = 0; i < t->n_attrs; i++) {
+			const char* an = t->attrs[i].name;
+			if (0==strncmp(an, "xmlns:", 6) && 0==strncmp(an + 6, prefix, len) && !an[6 + len])
+				return t->attrs[i].value[0] ? XML_ns(t->attrs[i].value) : NULL;
+		}
+	}
+	if (len == 3 && 0==memcmp(prefix, "xml", 3)) return XML_ns("http://www.w3.org/XML/1998/namespace");
+	if (len == 5 && 0==memcmp(prefix, "xmlns", 5)) return XML_ns("http://www.w3.org/2000/xmlns/");
+	return NULL;
+}
+// Binds the prefixes a tag declares, then resolves the tag's own and its
+// attributes'.  Returns 0 if any prefix isn't bound.  attr_ns gets as many
+// entries as the tag has room for attributes.
+uint XML_resolve_ns (XML_ParseState* s, const char* name, XML_Attr* attrs, uint n_attrs, uint cap_attrs, const char** ns, const char** local, const char*** attr_ns) {
+	uint i;
+	for (i = 0; i < n_attrs; i++) {
+		const char* an = attrs[i].name;
+		if (0!=strncmp(an, "xmlns", 5) || (an[5] && an[5] != ':')) continue;
+		if (an[5] && !attrs[i].value[0]) return 0;  // Can't unbind a prefix
+		s->bindings = XML_grow(s->bindings, s->n_bindings, &s->cap_bindings, sizeof(XML_NsBinding));
+		s->bindings[s->n_bindings].prefix = an[5] ? an + 6 : "";
+		s->bindings[s->n_bindings].len = an[5] ? strlen(an + 6) : 0;
+		s->bindings[s->n_bindings].ns = attrs[i].value[0] ? XML_ns(attrs[i].value) : NULL;
+		s->n_bindings++;
+	}
+	const char* colon = strchr(name, ':');
+	*ns = XML_lookup_ns(s, name, colon ? colon - name : 0);
+	*local = colon ? colon + 1 : name;
+	if (*ns == XML_unbound) return 0;
+	*attr_ns = NULL;
+	for (i = 0; i < n_attrs; i++) {
+		colon = strchr(attrs[i].name, ':');
+		if (!colon) continue;
+		const char* ans = XML_lookup_ns(s, attrs[i].name, colon - attrs[i].name);
+		if (ans == XML_unbound) return 0;
+		if (!*attr_ns) {
+			*attr_ns = XML_alloc(cap_attrs * sizeof(const char*));
+			memset(*attr_ns, 0, cap_attrs * sizeof(const char*));
+		}
+		(*attr_ns)[i] = ans;
+	}
+	return 1;
+}
+
+// Characters XML doesn't allow, even as UTF-8
+uint XML_is_bad_control (unsigned char c) { return c < 0x20 && c != '\t' && c != '\n' && c != '\r'; }
+// Returns the length of the longest prefix of s that's valid UTF-8 with only
+// characters XML allows.  Eight ASCII bytes at a time go by with one test,
+// plus one more for each control character among them.
+uint XML_utf8_prefix (const char* s, uint n) {
+	const unsigned char* u = (const unsigned char*)s;
+	uint i = 0;
+	while (i < n) {
+		if (i + 8 <= n) {
+			uint64_t w;
+			memcpy(&w, u + i, 8);
+			if (!(w & 0x8080808080808080ull)) {
+				// The high bit of each byte below 0x20, which had better be whitespace
+				uint64_t low = (((w | 0x8080808080808080ull) - 0x2020202020202020ull) ^ 0x8080808080808080ull) & 0x8080808080808080ull;
+				for (; low; low &= low - 1) {
+					uint at = i + __builtin_ctzll(low) / 8;
+					if (XML_is_bad_control(u[at])) return at;
+				}
+				i += 8;
+				continue;
+			}
+		}
+		unsigned char c = u[i];
+		if (c < 0x80) {
+			if (XML_is_bad_control(c)) return i;
+			i++;
+			continue;
+		}
+		uint len;
+		unsigned long cp;
+		if (c >= 0xC2 && c <= 0xDF) { len = 2; cp = c & 0x1F; }
+		else if (c >= 0xE0 && c <= 0xEF) { len = 3; cp = c & 0x0F; }
+		else if (c >= 0xF0 && c <= 0xF4) { len = 4; cp = c & 0x07; }
+		else return i;
+		if (i + len > n) return i;
+		uint j;
+		for (j = 1; j < len; j++) {
+			if ((u[i+j] & 0xC0) != 0x80) return i;
+			cp = cp << 6 | (u[i+j] & 0x3F);
+		}
+		if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) || cp > 0x10FFFF) return i;  // Overlong or too big
+		if ((cp >= 0xD800 && cp <= 0xDFFF) || cp == 0xFFFE || cp == 0xFFFF) return i;
+		i += len;
+	}
+	return n;
+}
+// Every name, value and text run goes through here right after it's been
+// scanned, so only the bytes between markup are checked
+uint XML_check_utf8 (const XML_ParseOptions* o, const char* start, const char* end) {
+	if (!(o->flags & XML_PARSE_VALIDATE_UTF8)) return 1;
+	uint good = XML_utf8_prefix(start, end - start);
+	if (start + good == end) return 1;
+	failp = start + good;
+	unsigned char lead = *failp;
+	uint need = lead < 0xC2 ? 0 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : lead < 0xF5 ? 4 : 0;
+	if (!*end && end - failp < need) failp = end;  // The input ends partway through a character
+	return 0;
+}
+// The decoder keeps a character reference it can't use as it is, so when
+// validating, text and values are also checked for one of those
+uint XML_check_refs (const XML_ParseOptions* o, const char* start, const char* end) {
+	if (!(o->flags & XML_PARSE_VALIDATE_UTF8)) return 1;
+	char decoded [4];
+	uint n;
+	const char* p = start;
+	while ((p = memchr(p, '&', end - p))) {
+		if (p[1] == '#' && !XML_decode_ref(p, end - p, decoded, &n)) {
+			failp = p;
+			return 0;
+		}
+		p++;
+	}
+	return 1;
+}
+// Tags parsed with a string pool don't own their strings; the pool does
+XML_Tag* XML_parsed_tag (const XML_ParseOptions* o, const char* name, uint n_attrs, uint cap_attrs, XML_Attr* attrs, uint n_contents, uint cap_contents, XML* contents) {
+	XML_Tag* r = XML_alloc_tag();
+	r->is_str = 0;
+	r->flags = (o->pool ? XML_POOL_STRINGS : XML_OWNS_STRINGS) | XML_DIRTY;
+	r->len = 0;
+	r->name = name;
+	r->n_attrs = n_attrs;
+	r->attrs = attrs;
+	r->n_contents = n_contents;
+	r->contents = contents;
+	r->parent = NULL;
+	r->cap_attrs = cap_attrs;
+	r->cap_contents = cap_contents;
+	r->hash = 0;
+	r->extra = NULL;
+	XML_adopt(r);
+	XML_STAT_ADD(nodes, 1);
+	return r;
+}
+// Copies a run of the input as it is, for CDATA, comments and PIs
+const char* XML_copy_run (const char* start, const char* end) {
+	char* r = XML_alloc_atomic(end - start + 1);
+	memcpy(r, start, end - start);
+	r[end - start] = 0;
+	return (const char*)r;
+}
+// Where every string the parser keeps comes from
+const char* XML_parsed_run (const XML_ParseOptions* o, const char* start, const char* end, uint unescape) {
+	if (o->pool) return XML_pool_run(o->pool, start, end - start, unescape);
+	if (unescape) return XML_unescape_run(start, end - start);
+	return XML_copy_run(start, end);
+}
+void XML_parsed_dealloc (const XML_ParseOptions* o, const char* s) {
+	if (!o->pool) XML_dealloc((void*)s);
+}
+XML XML_misc_tag (const XML_ParseOptions* o, uint kind, const char* name, const char* data) {
+	XML* contents = NULL;
+	if (data) {
+		contents = XML_alloc(sizeof(XML));
+		contents[0].str = data;
+	}
+	XML_Tag* r = XML_parsed_tag(o, name, 0, 0, NULL, data ? 1 : 0, data ? 1 : 0, contents);
+	r->flags |= kind;
+	return (XML)r;
+}
+// Whether the input ends partway through s, so more of it might finish s.
+// This looks no further than s is long, since it runs once per root.
+uint XML_cut_short (const char* p, const char* s) {
+	for (; *s; p++, s++) {
+		if (!*p) return 1;
+		if (*p != *s) return 0;
+	}
+	return 0;
+}
+// Parses a comment, CDATA section or processing instruction at *pp.  Returns
+// 0 on a syntax error, with failp set (to the end of the input if it ran out
+// first), otherwise sets *out to what should be kept of it, if anything.
+// CDATA is text that's copied whole without being unescaped.  With out NULL
+// nothing is kept or allocated, and it's only checked and skipped.
+uint XML_parse_misc (const char** pp, const XML_ParseOptions* o, XML* out) {
+	const char* p = *pp;
+	const char* end;
+	if (out) out->tag = NULL;
+	if (0==strncmp(p, "<!--", 4)) {
+		end = strstr(p + 4, "-->");
+		if (!end) goto CUT;
+		if (!XML_check_utf8(o, p + 4, end)) return 0;
+		if (out && o->flags & XML_PARSE_KEEP_COMMENTS)
+			*out = XML_misc_tag(o, XML_COMMENT, XML_parsed_run(o, p + 4, end, 0), NULL);
+		*pp = end + 3;
+		return 1;
+	}
+	if (0==strncmp(p, "<![CDATA[", 9)) {
+		end = strstr(p + 9, "]]>");
+		if (!end) goto CUT;
+		if (!XML_check_utf8(o, p + 9, end)) return 0;
+		if (out && end > p + 9) out->str = XML_parsed_run(o, p + 9, end, 0);  // An empty string would look like a tag
+		*pp = end + 3;
+		return 1;
+	}
+	if (p[1] == '?') {
+		end = strstr(p + 2, "?>");
+		if (!end) goto CUT;
+		if (!XML_check_utf8(o, p + 2, end)) return 0;
+		const char* data = p + 2;
+		while (data < end && !isspace(*data)) data++;
+		if (data == p + 2) goto ERR;  // No target
+		if (out && o->flags & XML_PARSE_KEEP_PIS) {
+			const char* target = XML_parsed_run(o, p + 2, data, 0);
+			while (data < end && isspace(*data)) data++;
+			*out = XML_misc_tag(o, XML_PI, target, data < end ? XML_parsed_run(o, data, end, 0) : NULL);
+		}
+		*pp = end + 2;
+		return 1;
+	}
+	// Only now, since it's rare, see whether it was a start cut off
+	if (XML_cut_short(p, "<!--") || XML_cut_short(p, "<![CDATA[")) goto CUT;
+	ERR:
+		failp = p;
+		return 0;
+	CUT:
+		failp = p + strlen(p);
+		return 0;
+}
+// Where an attribute's name and still escaped value are in the input
+typedef struct XML_AttrRun {
+	const char* name;
+	const char* name_end;
+	const char* value;
+	const char* value_end;
+} XML_AttrRun;
+
+// Scans one attribute at *pp without copying anything.  Returns 0 on a syntax
+// error, with failp set.
+uint XML_scan_attr (const char** pp, XML_Scan* sc, const XML_ParseOptions* o, XML_AttrRun* run) {
+	const char* p = *pp;
+	run->name = p;
+	p = XML_scan_to(sc, p, XML_TO_NAME_END);
+	run->name_end = p;
+	if (p == run->name) goto ERR;
+	if (!XML_check_utf8(o, run->name, p)) return 0;
+	XML_eatws(&p);
+	if (*p++ != '=') goto ERR;
+	XML_eatws(&p);
+	if (*p++ != '"') goto ERR;
+	run->value = p;
+	p = XML_scan_to(sc, p, XML_TO_QUOTE);
+	if (!*p) goto ERR;  // Ran out
+	run->value_end = p;
+	if (!XML_check_utf8(o, run->value, p) || !XML_check_refs(o, run->value, p)) return 0;
+	*pp = p + 1;  // After the closing quote
+	return 1;
+	ERR:
+		failp = p;
+		return 0;
+}
+// Decodes a run of text into *out, or gives 0 if the options drop it.
+// Whitespace is dropped before anything is allocated for it.
+uint XML_parsed_text (const XML_ParseOptions* o, const char* start, const char* end, XML* out) {
+	const char* first = start;
+	const char* last = end;
+	if (o->flags & (XML_PARSE_DROP_WHITESPACE | XML_PARSE_TRIM_TEXT)) {
+		while (first < last && isspace(*first)) first++;
+		if (first == last) return 0;
+		if (o->flags & XML_PARSE_TRIM_TEXT) while (isspace(last[-1])) last--;
+		else first = start;
+	}
+	out->str = XML_parsed_run(o, first, last, 1);
+	return 1;
+}
+// Skips what may come before and after the root: whitespace, comments, PIs
+// (including the XML declaration) and, before it, a doctype.  Returns 0 if it
+// stopped at one of those that's broken or cut off, with failp set.  They're
+// checked for bad UTF-8 if o asks for it, like everything inside the root.
+uint XML_skip_prolog (const char** pp, uint doctype, const XML_ParseOptions* o) {
+	XML_ParseOptions skip = {o->flags & XML_PARSE_VALIDATE_UTF8};
+	for (;;) {
+		XML_eatws(pp);
+		const char* p = *pp;
+		if (p[0] != '<') return 1;
+		if (XML_cut_short(p, "<!--") || (doctype && XML_cut_short(p, "<!DOCTYPE"))) {
+			failp = p + strlen(p);
+			return 0;
+		}
+		if (p[1] == '?' || 0==strncmp(p, "<!--", 4)) {
+			if (!XML_parse_misc(pp, &skip, NULL)) return 0;
+		}
+		else if (doctype && 0==strncmp(p, "<!DOCTYPE", 9)) {
+			uint depth = 0;
+			char quote = 0;
+			for (p += 9; *p; p++) {
+				if (quote) { if (*p == quote) quote = 0; }
+				else if (*p == '"' || *p == '\'') quote = *p;
+				else if (*p == '[') depth++;
+				else if (*p == ']' && depth) depth--;
+				else if (*p == '>' && !depth) break;
+			}
+			if (!*p) {
+				failp = p;
+				return 0;
+			}
+			if (!XML_check_utf8(&skip, *pp + 9, p)) return 0;
+			*pp = p + 1;
+		}
+		else return 1;
+	}
+}
+
+uint XML_index_tag (const char**, XML_Scan*, const XML_ParseOptions*, XML_Index*);
+
+// Whether the depth-th step of a path is the name, or *
+uint XML_path_step_is (const char* path, uint depth, const char* name, uint len) {
+	for (; depth; depth--) {
+		path = strchr(path, '/');
+		if (!path) return 0;
+		path++;
+	}
+	uint n = strcspn(path, "/");
+	return (n == 1 && path[0] == '*') || (n == len && 0==memcmp(path, name, len));
+}
+uint XML_path_steps (const char* path) {
+	uint n = 1;
+	for (; *path; path++) n += *path == '/';
+	return n;
+}
+// The paths among alive that a tag at depth with this name is on
+uint64_t XML_paths_through (const XML_ParseState* s, uint64_t alive, const char* name, uint len) {
+	uint64_t r = 0;
+	for (; alive; alive &= alive - 1) {
+		uint i = __builtin_ctzll(alive);
+		if (XML_path_step_is(s->o->paths[i], s->depth, name, len)) r |= 1ull << i;
+	}
+	return r;
+}
+uint XML_name_in (const char* const* names, const char* name, uint len) {
+	if (names)
+	for (; *names; names++)
+	if (strlen(*names) == len && 0==memcmp(*names, name, len))
+		return 1;
+	return 0;
+}
+// Whether the tag at p should be parsed or skipped, going by the filters
+uint XML_wanted (const XML_ParseState* s, const char* p) {
+	const XML_ParseOptions* o = s->o;
+	p++;
+	XML_eatws(&p);
+	uint len = XML_scan_to(s->scan, p, XML_TO_NAME_END) - p;
+	if (!len) return 1;  // Let the parser report it
+	if (XML_name_in(o->exclude, p, len)) return 0;
+	if (s->within || o->include || !o->paths) return 1;  // Included tags may be anywhere under it
+	return !!XML_paths_through(s, s->alive, p, len);
+}
+
+XML XML_parse_tag_in (const char** pp, XML_ParseState* s) {
+	const XML_ParseOptions* o = s->o;
+	const char* p = *pp;
+	const char* start;
+	uint outer_bindings = s->n_bindings;
+	const char* ns = NULL;
+	const char* local = NULL;
+	const char** attr_ns = NULL;
+	XML_Tag* r;
+	const char* name = NULL;
+	uint n_attrs = 0;
+	uint cap_attrs = 0;
+	XML_Attr* attrs = NULL;
+	uint n_contents = 0;
+	uint cap_contents = 0;
+	XML* contents = NULL;
+	uint i;
+	uint64_t alive = 0;
+	uint64_t ends = 0;  // The paths that end here
+	uint within = s->within;
+	if (*p++ != '<') goto ERR_NEW;
+	XML_eatws(&p);
+	if (!*p) goto ERR_NEW;
+	start = p;
+	p = XML_scan_to(s->scan, p, XML_TO_NAME_END);
+	if (p == start) goto ERR_NEW;
+	if (!XML_check_utf8(o, start, p)) goto ERR_PROP;
+	if (o->paths) {
+		alive = XML_paths_through(s, s->alive, start, p - start);
+		uint64_t left;
+		for (left = alive; left; left &= left - 1) {
+			uint k = __builtin_ctzll(left);
+			if (XML_path_steps(o->paths[k]) == s->depth + 1) ends |= 1ull << k;
+		}
+		within |= !!ends;
+	}
+	if (!within) within = XML_name_in(o->include, start, p - start);
+	// Looking for included tags under it, keeping nothing else
+	uint hunting = o->include && !within && !alive;
+	name = XML_parsed_run(o, start, p, 0);
+	XML_eatws(&p);
+	while (XML_isnamechar(*p)) {
+		XML_AttrRun run;
+		if (!XML_scan_attr(&p, s->scan, o, &run)) goto ERR_PROP;
+		attrs = XML_grow(attrs, n_attrs, &cap_attrs, sizeof(XML_Attr));
+		attrs[n_attrs].name = XML_parsed_run(o, run.name, run.name_end, 0);
+		attrs[n_attrs].value = XML_parsed_run(o, run.value, run.value_end, 1);
+		n_attrs++;
+		XML_eatws(&p);
+		if (!*p) goto ERR_NEW;
+	}
+	if (o->flags & XML_PARSE_NAMESPACES
+	 && !XML_resolve_ns(s, name, attrs, n_attrs, cap_attrs, &ns, &local, &attr_ns)) {
+		failp = *pp;
+		goto ERR_PROP;
+	}
+	if (*p == '/') {
+		p++;
+		XML_eatws(&p);
+		if (*p++ != '>') goto ERR_NEW;
+		r = XML_parsed_tag(o, name, n_attrs, cap_attrs, attrs, 0, 0, NULL);
+		goto DONE;
+	}
+	else if (*p == '>') {
+		p++;
+		if (!*p) goto ERR_NEW;
+		for (;;) {
+			if (*p == '<' && (p[1] == '!' || p[1] == '?')) {
+				XML misc = {NULL};
+				if (!XML_parse_misc(&p, o, hunting ? NULL : &misc)) goto ERR_PROP;
+				if (misc.tag) {
+					contents = XML_grow(contents, n_contents, &cap_contents, sizeof(XML));
+					contents[n_contents] = misc;
+					n_contents++;
+				}
+			}
+			else if (*p == '<') {
+				const char* tagp = p;
+				p++;
+				XML_eatws(&p);
+				if (*p == '/') {
+					p++;
+					XML_eatws(&p);
+					uint namelen = strlen(name);
+					for (i = 0; i < namelen; i++)
+					if (*p++ != name[i])
+						goto ERR_NEW;
+					XML_eatws(&p);
+					if (*p++ != '>') goto ERR_NEW;
+					r = XML_parsed_tag(o, name, n_attrs, cap_attrs, attrs, n_contents, cap_contents, contents);
+					goto DONE;
+				}
+				else {
+					p = tagp;
+					s->depth++;
+					uint64_t outer_alive = s->alive;
+					uint outer_within = s->within;
+					s->alive = alive;
+					s->within = within;
+					if (!XML_wanted(s, p)) {
+						uint ok = XML_index_tag(&p, s->scan, o, NULL);
+						s->depth--;
+						s->alive = outer_alive;
+						s->within = outer_within;
+						if (!ok) goto ERR_PROP;
+						continue;
+					}
+					XML child = XML_parse_tag_in(&p, s);
+					s->depth--;
+					s->alive = outer_alive;
+					s->within = outer_within;
+					if (!XML_is_valid(child)) goto ERR_PROP;
+					if (s->empty) XML_free(child);  // Nothing included was in it
+					else {
+						contents = XML_grow(contents, n_contents, &cap_contents, sizeof(XML));
+						contents[n_contents] = child;
+						n_contents++;
+					}
+					if (s->stopped) {
+						// Everything asked for has been read, so leave the rest
+						r = XML_parsed_tag(o, name, n_attrs, cap_attrs, attrs, n_contents, cap_contents, contents);
+						goto DONE;
+					}
+				}
+			}
+			else {
+				start = p;
+				p = XML_scan_to(s->scan, p, XML_TO_LT);
+				if (!*p) goto ERR_NEW;
+				if (!XML_check_utf8(o, start, p) || !XML_check_refs(o, start, p)) goto ERR_PROP;
+				XML text;
+				if (hunting || !XML_parsed_text(o, start, p, &text)) continue;
+				contents = XML_grow(contents, n_contents, &cap_contents, sizeof(XML));
+				contents[n_contents] = text;
+				n_contents++;
+			}
+		}
+	}
+	else goto ERR_NEW;
+	DONE:
+		if (o->flags & XML_PARSE_NAMESPACES && (ns || local != name || attr_ns)) {
+			XML_TagExtra* x = XML_extra(r);
+			x->ns = ns;
+			x->local = local != name ? local : NULL;
+			x->attr_ns = attr_ns;
+		}
+		if (o->cons) r = XML_cons(o->cons, r);
+		else if (o->flags & XML_PARSE_HASH) XML_hash((XML)r);
+		s->n_bindings = outer_bindings;
+		s->found |= ends;
+		if (o->paths && s->found == s->all) s->stopped = 1;
+		s->empty = hunting && !n_contents && s->depth;
+		*pp = p;
+		return (XML)r;
+	ERR_NEW:
+		failp = p;
+	ERR_PROP:
+		s->n_bindings = outer_bindings;
+		if (attr_ns) XML_dealloc(attr_ns);
+		XML_parsed_dealloc(o, name);
+		for (i = 0; i < n_attrs; i++) {
+			XML_parsed_dealloc(o, attrs[i].name);
+			XML_parsed_dealloc(o, attrs[i].value);
+		}
+		XML_dealloc(attrs);
+		for (i = 0; i < n_contents; i++) {
+			if (XML_is_str(contents[i])) XML_parsed_dealloc(o, contents[i].str);
+			else XML_free(contents[i]);
+		}
+		XML_dealloc(contents);
+		return (XML)(XML_Tag*)NULL;
+}
+// Sets *stopped if the parse ended early because every path was found
+XML XML_parse_root (const char** pp, const char* end, const XML_ParseOptions* o, uint* stopped) {
+	XML_Scan scan;
+	XML_scan_init(&scan, *pp, end);
+	XML_ParseState s = {o, &scan};
+	if (o->paths) {
+		uint n = 0;
+		while (o->paths[n]) n++;
+		if (n > XML_MAX_PATHS) {  // They're kept in a bitset
+			failp = *pp;
+			*stopped = 0;
+			return (XML)(XML_Tag*)NULL;
+		}
+		s.all = n == 64 ? ~0ull : (1ull << n) - 1;
+		s.alive = s.all;
+	}
+	XML r = XML_parse_tag_in(pp, &s);
+	if (s.bindings) XML_dealloc(s.bindings);
+	if (!XML_is_valid(r) && failp > end) failp = end;  // Stepped past the terminator
+	*stopped = s.stopped;
+	return r;
+}
+XML XML_parse_tag_opts (const char** pp, const XML_ParseOptions* o) {
+	uint stopped;
+	return XML_parse_root(pp, *pp + strlen(*pp), o, &stopped);
+}
+XML XML_parse_tag (const char** pp) {
+	XML_ParseOptions o = {0};
+	return XML_parse_tag_opts(pp, &o);
+}
+
+XML XML_parse_opts (const char* p, const XML_ParseOptions* o) {
+	XML_PHASE_BEGIN(XML_PHASE_PARSE);
+	const char* start = p;
+	if (0==strncmp(p, "\xEF\xBB\xBF", 3)) p += 3;  // Byte order mark
+	uint stopped = 0;
+	XML r = {NULL};
+	if (XML_skip_prolog(&p, 1, o)) r = XML_parse_root(&p, p + strlen(p), o, &stopped);
+	if (XML_is_valid(r) && !stopped) {
+		uint ok = XML_skip_prolog(&p, 0, o);
+		if (!ok || *p) {
+			if (ok) failp = p;
+			XML_free(r);
+			r.tag = NULL;
+		}
+	}
+	failspot = failp - start;
+	endspot = p - start;
+	XML_STAT_ADD(bytes_scanned, (XML_is_valid(r) ? p : failp) - start);
+	XML_PHASE_END(XML_PHASE_PARSE);
+	return r;
+}
+XML XML_parse (const char* p) {
+	XML_ParseOptions o = {0};
+	return XML_parse_opts(p, &o);
+}
+// Parses with the given allocator instead of the thread's
+XML XML_parse_with (const XML_Allocator* a, const char* p) {
+	const XML_Allocator* old = XML_set_allocator(a);
+	XML r = XML_parse(p);
+	XML_set_allocator(old);
+	return r;
+}
+XML_Cursor XML_cursor (const char* src, const XML_ParseOptions* o) {
+	XML_Cursor r = {src, strlen(src), 0, 0, o};
+	return r;
+}
+// Parses the document at c->at and moves c->at past it.  Gives an invalid
+// XML at the end, or if the document is bad or cut off; then c->at stays put.
+XML XML_parse_next (XML_Cursor* c) {
+	XML_PHASE_BEGIN(XML_PHASE_PARSE);
+	XML_ParseOptions none = {0};
+	const XML_ParseOptions* o = c->o ? c->o : &none;
+	const char* end = c->src + c->len;
+	const char* p = c->src + c->at;
+	if (0==strncmp(p, "\xEF\xBB\xBF", 3)) p += 3;
+	XML r = {NULL};
+	uint prolog_ok = XML_skip_prolog(&p, 1, o);
+	uint ended = prolog_ok && !*p;  // Nothing but separators left
+	if (ended) failp = p;
+	else if (prolog_ok) {
+		const char* root = p;
+		uint stopped;
+		r = XML_parse_root(&p, end, o, &stopped);
+		if (XML_is_valid(r) && stopped) {
+			// Filtered, so skip what's left of it to find the next one
+			p = root;
+			XML_Scan scan;
+			XML_scan_init(&scan, p, end);
+			if (!XML_index_tag(&p, &scan, o, NULL)) {
+				if (failp > end) failp = end;
+				XML_free(r);
+				r.tag = NULL;
+			}
+		}
+	}
+	c->consumed = 0;
+	if (XML_is_valid(r) || ended) {
+		XML_skip_prolog(&p, 0, o);  // Separators and comments after a root go with it
+		c->consumed = p - (c->src + c->at);
+		c->at = p - c->src;
+	}
+	failspot = failp - c->src;
+	XML_STAT_ADD(bytes_scanned, c->consumed);
+	XML_PHASE_END(XML_PHASE_PARSE);
+	return r;
+}
+
+XML XML_parse_n (const char* p, uint n) {
+	char* realp = XML_alloc_atomic(n + 1);
+	memcpy(realp, p, n);
+	realp[n] = 0;
+	XML r = XML_parse((const char*)realp);
+	XML_dealloc(realp);
+	return r;
+}
+
+// A lazy parse checks the whole document first, allocating nothing but an
+// index of where each element is.  A tag's attributes and contents are made
+// from the source the first time something looks at them.
+typedef struct XML_IndexEntry {
+	uint start;  // At its '<'
+	uint body;  // Just after its start tag, or 0 if it's empty (<tag/>)
+	uint end;  // Just after its end tag
+	uint next;  // Its next sibling element, or 0 if it's the last
+} XML_IndexEntry;
+
+struct XML_Index {
+	const char* src;
+	XML_ParseOptions o;
+	const XML_Allocator* alloc;  // For the tags made later
+	uint n;
+	uint cap;
+	XML_IndexEntry* entries;  // In document order, so a tag's first child comes right after it
+};
+
+// Checks an element the same way XML_parse_tag_in does, adding entries for it
+// and everything in it, or just skipping it if ix is NULL.  Returns 0 on a
+// syntax error, with failp set.
+uint XML_index_tag (const char** pp, XML_Scan* sc, const XML_ParseOptions* o, XML_Index* ix) {
+	const char* p = *pp;
+	uint k = 0;
+	if (ix) {
+		ix->entries = XML_grow(ix->entries, ix->n, &ix->cap, sizeof(XML_IndexEntry));
+		k = ix->n++;
+		ix->entries[k].start = p - ix->src;
+		ix->entries[k].body = 0;
+		ix->entries[k].next = 0;
+	}
+	uint i;
+	if (*p++ != '<') goto ERR;
+	XML_eatws(&p);
+	const char* name = p;
+	p = XML_scan_to(sc, p, XML_TO_NAME_END);
+	uint namelen = p - name;
+	if (!namelen) goto ERR;
+	if (!XML_check_utf8(o, name, p)) return 0;
+	XML_eatws(&p);
+	while (XML_isnamechar(*p)) {
+		XML_AttrRun run;
+		if (!XML_scan_attr(&p, sc, o, &run)) return 0;
+		XML_eatws(&p);
+		if (!*p) goto ERR;
+	}
+	if (*p == '/') {
+		p++;
+		XML_eatws(&p);
+		if (*p++ != '>') goto ERR;
+	}
+	else if (*p == '>') {
+		p++;
+		if (!*p) goto ERR;
+		if (ix) ix->entries[k].body = p - ix->src;
+		XML_ParseOptions quiet = {o->flags & XML_PARSE_VALIDATE_UTF8};
+		uint last_child = 0;
+		for (;;) {
+			if (*p == '<' && (p[1] == '!' || p[1] == '?')) {
+				if (!XML_parse_misc(&p, &quiet, NULL)) return 0;
+			}
+			else if (*p == '<') {
+				const char* q = p + 1;
+				XML_eatws(&q);
+				if (*q == '/') {
+					p = q + 1;
+					XML_eatws(&p);
+					for (i = 0; i < namelen; i++)
+					if (*p++ != name[i])
+						goto ERR;
+					XML_eatws(&p);
+					if (*p++ != '>') goto ERR;
+					break;
+				}
+				uint child = ix ? ix->n : 0;
+				if (!XML_index_tag(&p, sc, o, ix)) return 0;
+				if (last_child) ix->entries[last_child].next = child;
+				last_child = child;
+			}
 			else {
-				const char* textesc = XML_extract_until(&p, XML_islt);
-				if (!textesc) goto ERR_NEW;
-				const char* text = XML_unescape(textesc);
-				contents = GC_realloc(contents, (n_contents + 1) * sizeof(XML));
-				contents[n_contents] = (XML)text;
-				n_contents++;
+				const char* start = p;
+				p = XML_scan_to(sc, p, XML_TO_LT);
+				if (!*p) goto ERR;
+				if (!XML_check_utf8(o, start, p) || !XML_check_refs(o, start, p)) return 0;
 			}
 		}
 	}
-	else goto ERR_NEW;
-	ERR_NEW:
+	else goto ERR;
+	if (ix) ix->entries[k].end = p - ix->src;
+	*pp = p;
+	return 1;
+	ERR:
 		failp = p;
-	ERR_PROP:
+		return 0;
+}
+void XML_index_free (XML_Index* ix) {
+	XML_dealloc(ix->entries);
+	XML_dealloc(ix);
+}
+XML_Tag* XML_lazy_tag (const XML_Index* ix, uint at) {
+	const char* name = ix->src + ix->entries[at].start + 1;
+	XML_eatws(&name);
+	const char* end = name + XML_scan_until(name, XML_isntnamechar);
+	XML_Tag* r = XML_parsed_tag(&ix->o, XML_parsed_run(&ix->o, name, end, 0), 0, 0, NULL, 0, 0, NULL);
+	r->flags |= XML_LAZY;
+	XML_TagExtra* x = XML_extra(r);
+	x->index = ix;
+	x->index_at = at;
+	return r;
+}
+// Makes a lazy tag's attributes and contents, with its child tags still lazy.
+// The index has already checked all of it, so nothing here can fail.
+void XML_expand (XML xml) {
+	if (!XML_is_valid(xml) || XML_is_str(xml) || !(xml.tag->flags & XML_LAZY)) return;
+	XML_Tag* t = xml.tag;
+	const XML_Index* ix = t->extra->index;
+	const XML_IndexEntry* e = &ix->entries[t->extra->index_at];
+	XML_ParseOptions quiet = ix->o;
+	quiet.flags &= ~XML_PARSE_VALIDATE_UTF8;
+	const XML_Allocator* old = XML_set_allocator(ix->alloc);
+	const char* p = ix->src + e->start + 1;
+	XML_eatws(&p);
+	p += XML_scan_until(p, XML_isntnamechar);
+	XML_eatws(&p);
+	while (XML_isnamechar(*p)) {
+		XML_AttrRun run;
+		XML_scan_attr(&p, NULL, &quiet, &run);
+		t->attrs = XML_grow(t->attrs, t->n_attrs, &t->cap_attrs, sizeof(XML_Attr));
+		t->attrs[t->n_attrs].name = XML_parsed_run(&quiet, run.name, run.name_end, 0);
+		t->attrs[t->n_attrs].value = XML_parsed_run(&quiet, run.value, run.value_end, 1);
+		t->n_attrs++;
+		XML_eatws(&p);
+	}
+	if (e->body) {
+		uint child = t->extra->index_at + 1;
+		if (child >= ix->n || ix->entries[child].start >= e->end) child = 0;
+		p = ix->src + e->body;
+		for (;;) {
+			XML c;
+			if (child && p == ix->src + ix->entries[child].start) {
+				c = (XML)XML_lazy_tag(ix, child);
+				p = ix->src + ix->entries[child].end;
+				child = ix->entries[child].next;
+			}
+			else if (*p == '<' && (p[1] == '!' || p[1] == '?')) {
+				XML_parse_misc(&p, &quiet, &c);
+				if (!c.tag) continue;
+			}
+			else if (*p == '<') break;  // Its end tag
+			else {
+				const char* start = p;
+				while (*p != '<') p++;
+				if (!XML_parsed_text(&quiet, start, p, &c)) continue;
+			}
+			t->contents = XML_grow(t->contents, t->n_contents, &t->cap_contents, sizeof(XML));
+			t->contents[t->n_contents++] = c;
+		}
+	}
+	XML_set_allocator(old);
+	t->flags &= ~XML_LAZY;
+	XML_adopt(t);
+}
+
+// Checks p and gives a root whose insides are made when they're looked at.
+// p has to outlive the tree.  Namespaces, hashing and cons tables aren't done.
+XML XML_parse_lazy (const char* p, const XML_ParseOptions* o) {
+	XML_PHASE_BEGIN(XML_PHASE_PARSE);
+	const char* start = p;
+	XML_Index* ix = XML_alloc(sizeof(XML_Index));
+	ix->src = start;
+	memset(&ix->o, 0, sizeof(XML_ParseOptions));
+	if (o) ix->o = *o;
+	ix->o.flags &= ~(XML_PARSE_NAMESPACES | XML_PARSE_HASH);
+	ix->o.cons = NULL;
+	ix->alloc = XML_allocator();
+	ix->n = 0;
+	ix->cap = 0;
+	ix->entries = NULL;
+	XML r = {NULL};
+	if (0==strncmp(p, "\xEF\xBB\xBF", 3)) p += 3;
+	if (XML_skip_prolog(&p, 1, &ix->o)) {
+		const char* end = p + strlen(p);
+		XML_Scan scan;
+		XML_scan_init(&scan, p, end);
+		if (XML_index_tag(&p, &scan, &ix->o, ix)) {
+			if (XML_skip_prolog(&p, 0, &ix->o)) {
+				if (*p) failp = p;
+				else r.tag = XML_lazy_tag(ix, 0);
+			}
+		}
+		else if (failp > end) failp = end;  // Stepped past the terminator
+	}
+	if (!XML_is_valid(r)) XML_index_free(ix);
+	failspot = failp - start;
+	XML_STAT_ADD(bytes_scanned, (XML_is_valid(r) ? p : failp) - start);
+	XML_PHASE_END(XML_PHASE_PARSE);
+	return r;
+}
+
+
+uint64_t XML_hash_bytes (const void* data, size_t n) {
+	// Eight bytes per step; the tail is folded in with its length
+	const unsigned char* p = data;
+	uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+	uint64_t w;
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, p, n);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 29;
+	return h;
+}
+
+uint64_t XML_hash_mix (uint64_t h, uint64_t v) {
+	h = (h + v) * 0x9e3779b97f4a7c15ull;
+	return h ^ h >> 32;
+}
+// Hashes a tree by its structure: names, attributes in order, and contents.
+// A tag's hash is cached and made from its children's, so after a change
+// only the tags above it are hashed again.  It's cached by the same rule as
+// the length (see XML_strlen_in), since borrowed strings can change under it.
+uint64_t XML_hash_in (XML xml, uint trusted) {
+	if (XML_is_str(xml)) return XML_hash_bytes(xml.str, strlen(xml.str));
+	XML_Tag* t = xml.tag;
+	if (t->hash) return t->hash;
+	XML_expand(xml);
+	trusted = trusted || t->flags & (XML_TRACKED | XML_FROZEN);
+	uint cache = trusted || t->flags & (XML_OWNS_STRINGS | XML_POOL_STRINGS);
+	uint64_t h = XML_hash_bytes(t->name, strlen(t->name)) ^ (t->flags & XML_MISC);
+	uint i;
+	for (i = 0; i < t->n_attrs; i++) {
+		h = XML_hash_mix(h, XML_hash_bytes(t->attrs[i].name, strlen(t->attrs[i].name)));
+		h = XML_hash_mix(h, XML_hash_bytes(t->attrs[i].value, strlen(t->attrs[i].value)));
+	}
+	h = XML_hash_mix(h, t->n_attrs);
+	for (i = 0; i < t->n_contents; i++) {
+		XML content = t->contents[i];
+		h = XML_hash_mix(h, XML_hash_in(content, trusted) + XML_is_str(content));
+		if (!XML_is_str(content) && !content.tag->hash) cache = 0;
+	}
+	if (!h) h = 1;
+	if (cache) t->hash = h;
+	return h;
+}
+uint64_t XML_hash (XML xml) { return XML_hash_in(xml, 0); }
+
+// Whether two tags have the same name, attributes and kind
+uint XML_same_outside (const XML_Tag* a, const XML_Tag* b) {
+	if ((a->flags & XML_MISC) != (b->flags & XML_MISC)
+	 || a->n_attrs != b->n_attrs || a->n_contents != b->n_contents
+	 || XML_tag_ns(a) != XML_tag_ns(b) || 0!=strcmp(a->name, b->name))
+		return 0;
+	const char** a_ns = XML_tag_attr_ns(a);
+	const char** b_ns = XML_tag_attr_ns(b);
+	uint i;
+	for (i = 0; i < a->n_attrs; i++)
+	if (0!=strcmp(a->attrs[i].name, b->attrs[i].name)
+	 || 0!=strcmp(a->attrs[i].value, b->attrs[i].value)
+	 || (a_ns ? a_ns[i] : NULL) != (b_ns ? b_ns[i] : NULL))
+		return 0;
+	return 1;
+}
+uint XML_equal (XML a, XML b) {
+	if (a.tag == b.tag) return 1;
+	if (!XML_is_valid(a) || !XML_is_valid(b)) return 0;
+	if (XML_is_str(a) || XML_is_str(b))
+		return XML_is_str(a) && XML_is_str(b) && 0==strcmp(a.str, b.str);
+	if (XML_hash(a) != XML_hash(b) || !XML_same_outside(a.tag, b.tag)) return 0;
+	uint i;
+	for (i = 0; i < a.tag->n_contents; i++)
+	if (!XML_equal(a.tag->contents[i], b.tag->contents[i]))
+		return 0;
+	return 1;
+}
+
+// Parsing with a cons table makes every tag that's the same as one made
+// before into that one.  Tags in the table are frozen and belong to it.
+struct XML_ConsTable {
+	const XML_Allocator* alloc;
+	uint n;
+	uint cap;  // A power of two
+	XML_Tag** slots;
+	unsigned long hits;  // How many tags were found already there
+};
+
+XML_ConsTable* XML_cons_new () {
+	const XML_Allocator* a = XML_allocator();
+	XML_ConsTable* r = XML_alloc_in(a, sizeof(XML_ConsTable));
+	r->alloc = a;
+	r->n = 0;
+	r->cap = 256;
+	r->slots = XML_alloc_in(a, r->cap * sizeof(XML_Tag*));
+	memset(r->slots, 0, r->cap * sizeof(XML_Tag*));
+	r->hits = 0;
+	return r;
+}
+void XML_cons_grow (XML_ConsTable* c) {
+	uint old_cap = c->cap;
+	XML_Tag** old = c->slots;
+	c->cap *= 2;
+	c->slots = XML_alloc_in(c->alloc, c->cap * sizeof(XML_Tag*));
+	memset(c->slots, 0, c->cap * sizeof(XML_Tag*));
+	uint i;
+	for (i = 0; i < old_cap; i++)
+	if (old[i]) {
+		uint j = old[i]->hash & (c->cap - 1);
+		while (c->slots[j]) j = (j + 1) & (c->cap - 1);
+		c->slots[j] = old[i];
+	}
+	XML_dealloc_in(c->alloc, old);
+}
+// Children are consed before their parents, so they can be compared by pointer
+uint XML_same_shallow (const XML_Tag* a, const XML_Tag* b) {
+	if (!XML_same_outside(a, b)) return 0;
+	uint i;
+	for (i = 0; i < a->n_contents; i++) {
+		XML ac = a->contents[i];
+		XML bc = b->contents[i];
+		if (XML_is_str(ac) != XML_is_str(bc)) return 0;
+		if (XML_is_str(ac) ? 0!=strcmp(ac.str, bc.str) : ac.tag != bc.tag) return 0;
+	}
+	return 1;
+}
+// Gives the table's copy of t, freeing t if there already was one
+XML_Tag* XML_cons (XML_ConsTable* c, XML_Tag* t) {
+	if (2 * (c->n + 1) > c->cap) XML_cons_grow(c);
+	uint64_t h = XML_hash((XML)t);
+	uint j = h & (c->cap - 1);
+	for (; c->slots[j]; j = (j + 1) & (c->cap - 1))
+	if (c->slots[j]->hash == h && XML_same_shallow(c->slots[j], t)) {
+		c->hits++;
+		XML_free((XML)t);
+		return c->slots[j];
+	}
+	XML_freeze((XML)t);
+	c->slots[j] = t;
+	c->n++;
+	return t;
+}
+// Frees the table and every tree parsed with it
+void XML_cons_free (XML_ConsTable* c) {
+	const XML_Allocator* old = XML_set_allocator(c->alloc);
+	uint i;
+	uint j;
+	// Text first, while every tag is still there to tell text from tags
+	for (i = 0; i < c->cap; i++)
+	if (c->slots[i] && c->slots[i]->flags & XML_OWNS_STRINGS)
+	for (j = 0; j < c->slots[i]->n_contents; j++)
+	if (XML_is_str(c->slots[i]->contents[j]))
+		XML_dealloc((void*)c->slots[i]->contents[j].str);
+	for (i = 0; i < c->cap; i++)
+	if (c->slots[i])
+		XML_free_rest(c->slots[i]);
+	XML_set_allocator(old);
+	XML_dealloc_in(c->alloc, c->slots);
+	XML_dealloc_in(c->alloc, c);
+}
+
+
+#define XML_BIN_VERSION 1
+#define XML_BIN_STR 0x80000000u  // Marks a reference to text instead of a tag
+
+typedef struct XML_BinHeader {
+	char magic[4];  // "XMLB"
+	uint version;
+	uint size;  // Of the whole image, header included
+	uint checksum;  // Of everything after the header
+	uint root;
+} XML_BinHeader;
+
+// All references are byte offsets from the start of the image
+typedef struct XML_BinTag {
+	uint name;
+	uint flags;  // XML_COMMENT or XML_PI, or 0 for an element
+	uint n_attrs;
+	uint attrs;  // n_attrs pairs of (name, value)
+	uint n_contents;
+	uint contents;  // n_contents references, XML_BIN_STR set for text
+} XML_BinTag;
+
+typedef struct XML_Bin {
+	const char* base;
+	uint off;  // 0 if invalid
+} XML_Bin;
+
+typedef struct XML_BinBuf {
+	char* data;
+	uint size;
+	uint cap;
+} XML_BinBuf;
+
+uint XML_bin_reserve (XML_BinBuf* b, uint n, uint align) {
+	uint off = (b->size + align - 1) & ~(align - 1);
+	if (off + n > b->cap) {
+		uint old = b->cap;
+		while (off + n > b->cap) b->cap *= 2;
+		b->data = XML_realloc(b->data, old, b->cap);
+	}
+	memset(b->data + b->size, 0, off + n - b->size);
+	b->size = off + n;
+	return off;
+}
+uint XML_bin_put_str (XML_BinBuf* b, const char* s) {
+	uint len = strlen(s) + 1;
+	uint off = XML_bin_reserve(b, len, 1);
+	memcpy(b->data + off, s, len);
+	return off;
+}
+uint XML_bin_put (XML_BinBuf* b, XML xml) {
+	if (XML_is_str(xml)) return XML_bin_put_str(b, xml.str) | XML_BIN_STR;
+	XML_expand(xml);
+	uint off = XML_bin_reserve(b, sizeof(XML_BinTag), 4);
+	uint name = XML_bin_put_str(b, xml.tag->name);
+	uint attrs = XML_bin_reserve(b, xml.tag->n_attrs * 2 * sizeof(uint), 4);
+	uint i;
+	for (i = 0; i < xml.tag->n_attrs; i++) {
+		uint attrname = XML_bin_put_str(b, xml.tag->attrs[i].name);
+		uint attrvalue = XML_bin_put_str(b, xml.tag->attrs[i].value);
+		((uint*)(b->data + attrs))[2*i] = attrname;
+		((uint*)(b->data + attrs))[2*i+1] = attrvalue;
+	}
+	uint contents = XML_bin_reserve(b, xml.tag->n_contents * sizeof(uint), 4);
+	for (i = 0; i < xml.tag->n_contents; i++) {
+		uint content = XML_bin_put(b, xml.tag->contents[i]);
+		((uint*)(b->data + contents))[i] = content;
+	}
+	XML_BinTag* t = (XML_BinTag*)(b->data + off);
+	t->name = name;
+	t->flags = xml.tag->flags & XML_MISC;
+	t->n_attrs = xml.tag->n_attrs;
+	t->attrs = attrs;
+	t->n_contents = xml.tag->n_contents;
+	t->contents = contents;
+	return off;
+}
+uint XML_bin_checksum (const char* image, uint size) {
+	uint64_t h = XML_hash_bytes(image + sizeof(XML_BinHeader), size - sizeof(XML_BinHeader));
+	return (uint)(h ^ (h >> 32));
+}
+const char* XML_save_binary (XML xml, uint* size) {
+	XML_BinBuf b;
+	b.cap = 256;
+	b.size = 0;
+	b.data = XML_alloc_atomic(b.cap);
+	XML_bin_reserve(&b, sizeof(XML_BinHeader), 4);
+	uint root = XML_bin_put(&b, xml);
+	XML_BinHeader* h = (XML_BinHeader*)b.data;
+	memcpy(h->magic, "XMLB", 4);
+	h->version = XML_BIN_VERSION;
+	h->size = b.size;
+	h->root = root;
+	h->checksum = XML_bin_checksum(b.data, b.size);
+	*size = b.size;
+	return (const char*)b.data;
+}
+
+XML_Bin XML_load_binary (const void* image, uint size) {
+	const XML_BinHeader* h = image;
+	XML_Bin r;
+	r.base = image;
+	r.off = 0;
+	if (size < sizeof(XML_BinHeader)) return r;
+	if (0!=memcmp(h->magic, "XMLB", 4)) return r;
+	if (h->version != XML_BIN_VERSION) return r;
+	if (h->size != size) return r;
+	if ((h->root & ~XML_BIN_STR) >= size) return r;
+	if (h->checksum != XML_bin_checksum(image, size)) return r;
+	r.off = h->root;
+	return r;
+}
+
+uint XML_bin_is_valid (XML_Bin b) { return b.off != 0; }
+uint XML_bin_is_str (XML_Bin b) { return b.off & XML_BIN_STR; }
+// The checksum only catches accidents, so every offset read out of the image
+// is checked against its size before it's followed.
+uint XML_bin_size (XML_Bin b) { return ((const XML_BinHeader*)b.base)->size; }
+const char* XML_bin_at (XML_Bin b, uint off) {
+	uint size = XML_bin_size(b);
+	if (off < sizeof(XML_BinHeader) || off >= size) return NULL;
+	if (!memchr(b.base + off, 0, size - off)) return NULL;
+	return b.base + off;
+}
+uint XML_bin_str_is (XML_Bin b, uint off, const char* s) {
+	uint size = XML_bin_size(b);
+	if (off < sizeof(XML_BinHeader) || off >= size) return 0;
+	const char* p = b.base + off;
+	const char* end = b.base + size;
+	for (; p < end && *p == *s; p++, s++)
+		if (!*s) return 1;
+	return 0;
+}
+// NULL for text, an invalid handle, or a tag that doesn't fit in the image
+const XML_BinTag* XML_bin_tag (XML_Bin b) {
+	if (!XML_bin_is_valid(b) || XML_bin_is_str(b)) return NULL;
+	uint64_t size = XML_bin_size(b);
+	if (b.off < sizeof(XML_BinHeader) || b.off & 3 || b.off + (uint64_t)sizeof(XML_BinTag) > size) return NULL;
+	const XML_BinTag* t = (const XML_BinTag*)(b.base + b.off);
+	if (t->attrs & 3 || t->attrs + (uint64_t)t->n_attrs * 2 * sizeof(uint) > size) return NULL;
+	if (t->contents & 3 || t->contents + (uint64_t)t->n_contents * sizeof(uint) > size) return NULL;
+	return t;
+}
+const char* XML_bin_str (XML_Bin b) {
+	if (!XML_bin_is_valid(b) || !XML_bin_is_str(b)) return NULL;
+	return XML_bin_at(b, b.off & ~XML_BIN_STR);
+}
+const char* XML_bin_name (XML_Bin b) {
+	const XML_BinTag* t = XML_bin_tag(b);
+	if (!t) return NULL;
+	return XML_bin_at(b, t->name);
+}
+uint XML_bin_n_contents (XML_Bin b) {
+	const XML_BinTag* t = XML_bin_tag(b);
+	if (!t) return 0;
+	return t->n_contents;
+}
+// Children are always written after their parents, so a reference backwards
+// can only be damage, and refusing it keeps a bad image from looping.
+XML_Bin XML_bin_content (XML_Bin b, uint i) {
+	XML_Bin r;
+	r.base = b.base;
+	r.off = 0;
+	const XML_BinTag* t = XML_bin_tag(b);
+	if (!t || i >= t->n_contents) return r;
+	uint off = ((const uint*)(b.base + t->contents))[i];
+	if ((off & ~XML_BIN_STR) <= b.off) return r;
+	r.off = off;
+	return r;
+}
+const char* XML_bin_get_attr (XML_Bin b, const char* name) {
+	const XML_BinTag* t = XML_bin_tag(b);
+	if (!t) return NULL;
+	const uint* attrs = (const uint*)(b.base + t->attrs);
+	uint i;
+	for (i = 0; i < t->n_attrs; i++)
+	if (XML_bin_str_is(b, attrs[2*i], name))
+		return XML_bin_at(b, attrs[2*i+1]);
+	return NULL;
+}
+XML_Bin XML_bin_get_child (XML_Bin b, const char* name) {
+	XML_Bin r;
+	r.base = b.base;
+	r.off = 0;
+	uint i, n = XML_bin_n_contents(b);
+	for (i = 0; i < n; i++) {
+		XML_Bin c = XML_bin_content(b, i);
+		const XML_BinTag* t = XML_bin_tag(c);
+		if (t && !t->flags && XML_bin_str_is(c, t->name, name)) return c;
+	}
+	return r;
+}
+// Invalid if any part of the image is out of bounds
+XML XML_bin_to_xml (XML_Bin b) {
+	if (XML_bin_is_str(b)) return (XML)XML_bin_str(b);
+	const XML_BinTag* t = XML_bin_tag(b);
+	if (!t || !XML_bin_at(b, t->name)) return (XML)(XML_Tag*)NULL;
+	const uint* attrs = (const uint*)(b.base + t->attrs);
+	uint i;
+	for (i = 0; i < t->n_attrs; i++)
+	if (!XML_bin_at(b, attrs[2*i]) || !XML_bin_at(b, attrs[2*i+1]))
 		return (XML)(XML_Tag*)NULL;
+	XML_Tag* r = XML_alloc_tag();
+	r->is_str = 0;
+	r->flags = XML_DIRTY | (t->flags & XML_MISC);
+	r->len = 0;
+	r->name = b.base + t->name;
+	r->parent = NULL;
+	r->cap_attrs = t->n_attrs;
+	r->cap_contents = t->n_contents;
+	r->hash = 0;
+	r->extra = NULL;
+	r->n_attrs = t->n_attrs;
+	r->attrs = XML_alloc(t->n_attrs * sizeof(XML_Attr));
+	for (i = 0; i < t->n_attrs; i++) {
+		r->attrs[i].name = b.base + attrs[2*i];
+		r->attrs[i].value = b.base + attrs[2*i+1];
+	}
+	r->n_contents = 0;
+	r->contents = XML_alloc(t->n_contents * sizeof(XML));
+	for (i = 0; i < t->n_contents; i++) {
+		XML content = XML_bin_to_xml(XML_bin_content(b, i));
+		if (!XML_is_valid(content)) {
+			XML_free((XML)r);
+			return content;
+		}
+		r->contents[r->n_contents++] = content;
+	}
+	XML_adopt(r);
+	XML_STAT_ADD(nodes, 1);
+	return (XML)r;
 }
-XML XML_parse (const char* p) {
-	XML r = XML_parse_tag(&p);
-	failspot = failp - p;
-	if (*p) return (XML)(XML_Tag*)NULL;
-	else return r;
+
+
+// Only counts what's been made of a lazy tree so far
+size_t XML_mem_size (XML xml) {
+	if (XML_is_str(xml)) return strlen(xml.str) + 1;
+	size_t r = sizeof(XML_Tag) + strlen(xml.tag->name) + 1;
+	r += xml.tag->n_attrs * sizeof(XML_Attr) + xml.tag->n_contents * sizeof(XML);
+	if (xml.tag->extra) r += sizeof(XML_TagExtra);
+	if (XML_tag_text(xml.tag)) r += xml.tag->len;
+	if (XML_tag_attr_ns(xml.tag)) r += xml.tag->n_attrs * sizeof(const char*);
+	uint i;
+	for (i = 0; i < xml.tag->n_attrs; i++) {
+		r += strlen(xml.tag->attrs[i].name) + 1;
+		r += strlen(xml.tag->attrs[i].value) + 1;
+	}
+	for (i = 0; i < xml.tag->n_contents; i++)
+		r += XML_mem_size(xml.tag->contents[i]);
+	return r;
 }
-XML XML_parse_n (const char* p, uint n) {
-	char* realp = GC_malloc(n + 1);
-	memcpy(realp, p, n);
-	realp[n] = 0;
-	return XML_parse((const char*)realp);
+
+typedef struct XML_CacheEntry {
+	struct XML_CacheEntry* next;  // In the same bucket
+	struct XML_CacheEntry* next_tree;  // In the same bucket of trees
+	struct XML_CacheEntry* newer;  // Or, once it's been dropped, the next one that's still out
+	struct XML_CacheEntry* older;
+	uint64_t hash;
+	const char* key;  // The input text, or the path for files
+	uint key_len;
+	uint is_file;
+	struct stat stamp;  // Of the file when it was read
+	size_t cost;
+	uint refs;  // Times it's been given out and not released, without libgc
+	uint in_table;
+	XML xml;
+} XML_CacheEntry;
+
+typedef struct XML_Cache {
+	const XML_Allocator* alloc;  // For the cache and the trees in it
+	XML_CacheEntry** buckets;
+	XML_CacheEntry** tree_buckets;  // Every entry that's still out, by its tree, for XML_cache_release
+	uint n_buckets;
+	uint n_entries;
+	XML_CacheEntry* newest;
+	XML_CacheEntry* oldest;
+	XML_CacheEntry* dropped;  // Out of the table but still held
+	size_t bytes;
+	size_t max_bytes;
+	unsigned long hits;
+	unsigned long misses;
+} XML_Cache;
+
+XML_Cache* XML_cache_new (size_t max_bytes) {
+	const XML_Allocator* a = XML_allocator();
+	XML_Cache* r = XML_alloc_in(a, sizeof(XML_Cache));
+	r->alloc = a;
+	r->n_buckets = 64;
+	r->buckets = XML_alloc_in(a, r->n_buckets * sizeof(XML_CacheEntry*));
+	memset(r->buckets, 0, r->n_buckets * sizeof(XML_CacheEntry*));
+	r->tree_buckets = XML_alloc_in(a, r->n_buckets * sizeof(XML_CacheEntry*));
+	memset(r->tree_buckets, 0, r->n_buckets * sizeof(XML_CacheEntry*));
+	r->n_entries = 0;
+	r->newest = NULL;
+	r->oldest = NULL;
+	r->dropped = NULL;
+	r->bytes = 0;
+	r->max_bytes = max_bytes;
+	r->hits = 0;
+	r->misses = 0;
+	return r;
+}
+
+void XML_cache_unlink (XML_Cache* c, XML_CacheEntry* e) {
+	if (e->newer) e->newer->older = e->older;
+	else c->newest = e->older;
+	if (e->older) e->older->newer = e->newer;
+	else c->oldest = e->newer;
+}
+void XML_cache_link (XML_Cache* c, XML_CacheEntry* e) {
+	e->newer = NULL;
+	e->older = c->newest;
+	if (c->newest) c->newest->newer = e;
+	else c->oldest = e;
+	c->newest = e;
+}
+uint XML_cache_tree_bucket (XML_Cache* c, XML xml) {
+	return ((uintptr_t)xml.tag >> 4) & (c->n_buckets - 1);
+}
+// Without a collector the tree is freed with its entry, so an entry that's
+// still held waits on the dropped list for its last XML_cache_release
+void XML_cache_free_entry (XML_Cache* c, XML_CacheEntry* e) {
+	const XML_Allocator* old = XML_set_allocator(c->alloc);
+	if (!XML_is_collected(c->alloc)) {
+		XML_CacheEntry** pe = &c->tree_buckets[XML_cache_tree_bucket(c, e->xml)];
+		while (*pe != e) pe = &(*pe)->next_tree;
+		*pe = e->next_tree;
+		XML_free_frozen(e->xml);
+	}
+	XML_dealloc((void*)e->key);
+	XML_dealloc(e);
+	XML_set_allocator(old);
+}
+void XML_cache_remove (XML_Cache* c, XML_CacheEntry* e) {
+	XML_CacheEntry** pe = &c->buckets[e->hash & (c->n_buckets - 1)];
+	while (*pe != e) pe = &(*pe)->next;
+	*pe = e->next;
+	XML_cache_unlink(c, e);
+	c->n_entries--;
+	c->bytes -= e->cost;
+	e->in_table = 0;
+	if (e->refs) {
+		e->newer = c->dropped;
+		c->dropped = e;
+	}
+	else XML_cache_free_entry(c, e);
+}
+void XML_cache_grow (XML_Cache* c) {
+	uint n = c->n_buckets * 2;
+	XML_CacheEntry** buckets = XML_alloc_in(c->alloc, n * sizeof(XML_CacheEntry*));
+	XML_CacheEntry** tree_buckets = XML_alloc_in(c->alloc, n * sizeof(XML_CacheEntry*));
+	memset(buckets, 0, n * sizeof(XML_CacheEntry*));
+	memset(tree_buckets, 0, n * sizeof(XML_CacheEntry*));
+	uint i;
+	for (i = 0; i < c->n_buckets; i++) {
+		XML_CacheEntry* e = c->buckets[i];
+		while (e) {
+			XML_CacheEntry* next = e->next;
+			e->next = buckets[e->hash & (n - 1)];
+			buckets[e->hash & (n - 1)] = e;
+			e = next;
+		}
+		e = c->tree_buckets[i];
+		while (e) {
+			XML_CacheEntry* next = e->next_tree;
+			uint b = ((uintptr_t)e->xml.tag >> 4) & (n - 1);
+			e->next_tree = tree_buckets[b];
+			tree_buckets[b] = e;
+			e = next;
+		}
+	}
+	XML_dealloc_in(c->alloc, c->buckets);
+	XML_dealloc_in(c->alloc, c->tree_buckets);
+	c->buckets = buckets;
+	c->tree_buckets = tree_buckets;
+	c->n_buckets = n;
+}
+XML_CacheEntry* XML_cache_find (XML_Cache* c, uint64_t hash, const char* key, uint key_len, uint is_file) {
+	XML_CacheEntry* e;
+	for (e = c->buckets[hash & (c->n_buckets - 1)]; e; e = e->next)
+	if (e->hash == hash && e->key_len == key_len && e->is_file == is_file)
+	if (0==memcmp(e->key, key, key_len))
+		return e;
+	return NULL;
+}
+// Gives the entry out once more; with libgc there's nothing to count
+XML XML_cache_hand_out (XML_Cache* c, XML_CacheEntry* e) {
+	if (!XML_is_collected(c->alloc)) e->refs++;
+	return e->xml;
+}
+// Makes an entry for a new tree, which has been handed out once.  A tree too
+// big for the cache goes straight to the dropped list, or with libgc nowhere.
+XML_CacheEntry* XML_cache_insert (XML_Cache* c, uint64_t hash, const char* key, uint key_len, uint is_file, XML xml) {
+	size_t cost = sizeof(XML_CacheEntry) + key_len + 1 + XML_mem_size(xml);
+	uint fits = cost <= c->max_bytes;
+	if (!fits && XML_is_collected(c->alloc)) return NULL;
+	if (fits) {
+		while (c->bytes + cost > c->max_bytes) XML_cache_remove(c, c->oldest);
+		if (c->n_entries >= c->n_buckets) XML_cache_grow(c);
+	}
+	XML_CacheEntry* e = XML_alloc_in(c->alloc, sizeof(XML_CacheEntry));
+	char* k = XML_alloc_atomic_in(c->alloc, key_len + 1);
+	memcpy(k, key, key_len);
+	k[key_len] = 0;
+	e->hash = hash;
+	e->key = k;
+	e->key_len = key_len;
+	e->is_file = is_file;
+	e->cost = cost;
+	e->refs = 0;
+	e->in_table = fits;
+	e->xml = xml;
+	if (!XML_is_collected(c->alloc)) {
+		e->refs = 1;
+		uint b = XML_cache_tree_bucket(c, xml);
+		e->next_tree = c->tree_buckets[b];
+		c->tree_buckets[b] = e;
+	}
+	if (fits) {
+		e->next = c->buckets[hash & (c->n_buckets - 1)];
+		c->buckets[hash & (c->n_buckets - 1)] = e;
+		XML_cache_link(c, e);
+		c->n_entries++;
+		c->bytes += cost;
+	}
+	else {
+		e->newer = c->dropped;
+		c->dropped = e;
+	}
+	return e;
+}
+// Without libgc, every tree a cache gives out has to be given back here once
+// the caller is done with it.  With libgc this does nothing.
+void XML_cache_release (XML_Cache* c, XML xml) {
+	if (XML_is_collected(c->alloc) || !XML_is_valid(xml)) return;
+	XML_CacheEntry* e = c->tree_buckets[XML_cache_tree_bucket(c, xml)];
+	while (e && e->xml.tag != xml.tag) e = e->next_tree;
+	if (!e || !e->refs || --e->refs || e->in_table) return;
+	XML_CacheEntry** pe = &c->dropped;
+	while (*pe != e) pe = &(*pe)->newer;
+	*pe = e->newer;
+	XML_cache_free_entry(c, e);
+}
+
+XML XML_cache_parse_n (XML_Cache* c, const char* p, uint n) {
+	uint64_t hash = XML_hash_bytes(p, n);
+	XML_CacheEntry* e = XML_cache_find(c, hash, p, n, 0);
+	if (e) {
+		c->hits++;
+		XML_cache_unlink(c, e);
+		XML_cache_link(c, e);
+		return XML_cache_hand_out(c, e);
+	}
+	c->misses++;
+	const XML_Allocator* old = XML_set_allocator(c->alloc);
+	XML r = XML_freeze(XML_parse_n(p, n));
+	if (XML_is_valid(r)) XML_cache_insert(c, hash, p, n, 0, r);
+	XML_set_allocator(old);
+	return r;
+}
+XML XML_cache_parse (XML_Cache* c, const char* p) {
+	return XML_cache_parse_n(c, p, strlen(p));
+}
+// The nanoseconds of a file's times, where the system says.  Systems that have
+// them define st_mtime as the seconds of them; macOS calls them st_mtimespec.
+#if defined(st_mtime) && defined(__APPLE__)
+#define XML_MTIME_NS(st) ((st)->st_mtimespec.tv_nsec)
+#define XML_CTIME_NS(st) ((st)->st_ctimespec.tv_nsec)
+#elif defined(st_mtime)
+#define XML_MTIME_NS(st) ((st)->st_mtim.tv_nsec)
+#define XML_CTIME_NS(st) ((st)->st_ctim.tv_nsec)
+#else
+#define XML_MTIME_NS(st) 0
+#define XML_CTIME_NS(st) 0
+#endif
+// Whether fileno and the rest of POSIX are declared, which they aren't in
+// strict ISO C mode unless asked for
+#if !defined(__STRICT_ANSI__) || defined(_POSIX_C_SOURCE)
+#define XML_POSIX 1
+#endif
+// Whether a file is still the one that was read.  The times go down to the
+// nanosecond where the system has them, and a file replaced by renaming
+// another over it has a new inode and ctime even if its size and mtime were
+// copied.
+uint XML_same_file (const struct stat* a, const struct stat* b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+	    && a->st_size == b->st_size
+	    && a->st_mtime == b->st_mtime && XML_MTIME_NS(a) == XML_MTIME_NS(b)
+	    && a->st_ctime == b->st_ctime && XML_CTIME_NS(a) == XML_CTIME_NS(b);
+}
+XML XML_cache_parse_file (XML_Cache* c, const char* path) {
+	// Stat what was opened if possible, so the stamp and the contents are
+	// the same file
+	FILE* f = fopen(path, "rb");
+	if (!f) return (XML)(XML_Tag*)NULL;
+	struct stat st;
+#ifdef XML_POSIX
+	int statted = fstat(fileno(f), &st);
+#else
+	int statted = stat(path, &st);
+#endif
+	if (statted != 0) {
+		fclose(f);
+		return (XML)(XML_Tag*)NULL;
+	}
+	uint path_len = strlen(path);
+	uint64_t hash = XML_hash_bytes(path, path_len);
+	XML_CacheEntry* e = XML_cache_find(c, hash, path, path_len, 1);
+	if (e) {
+		if (XML_same_file(&e->stamp, &st)) {
+			fclose(f);
+			c->hits++;
+			XML_cache_unlink(c, e);
+			XML_cache_link(c, e);
+			return XML_cache_hand_out(c, e);
+		}
+		XML_cache_remove(c, e);
+	}
+	c->misses++;
+	const XML_Allocator* old = XML_set_allocator(c->alloc);
+	char* text = XML_alloc_atomic(st.st_size + 1);
+	size_t got = fread(text, 1, st.st_size, f);
+	fclose(f);
+	text[got] = 0;
+	XML r = XML_freeze(XML_parse(text));
+	XML_dealloc(text);
+	if (XML_is_valid(r)) {
+		e = XML_cache_insert(c, hash, path, path_len, 1, r);
+		if (e && e->in_table) e->stamp = st;
+	}
+	XML_set_allocator(old);
+	return r;
+}
+
+// Frees every tree the cache gave out, released or not
+void XML_cache_free (XML_Cache* c) {
+	while (c->oldest) XML_cache_remove(c, c->oldest);
+	while (c->dropped) {
+		XML_CacheEntry* e = c->dropped;
+		c->dropped = e->newer;
+		XML_cache_free_entry(c, e);
+	}
+	XML_dealloc_in(c->alloc, c->buckets);
+	XML_dealloc_in(c->alloc, c->tree_buckets);
+	XML_dealloc_in(c->alloc, c);
 }
 
 
+// Counts live allocations so XML_test can check that everything is freed
+void* XML_test_alloc (void* ctx, size_t n) {
+	(*(long*)ctx)++;
+	return malloc(n ? n : 1);
+}
+void* XML_test_realloc (void* ctx, void* p, size_t old, size_t n) {
+	if (!p) (*(long*)ctx)++;
+	return realloc(p, n ? n : 1);
+}
+void XML_test_free (void* ctx, void* p) {
+	(*(long*)ctx)--;
+	free(p);
+}
 
 void XML_test () {
 	XML my_xml = XML_tag("tag-name",
@@ -445,6 +3797,530 @@ void XML_test () {
 		exit(1);
 	}
 	puts(XML_as_text(parsed));
+	uint size;
+	const char* image = XML_save_binary(parsed, &size);
+	XML_Bin bin = XML_load_binary(image, size);
+	if (!XML_bin_is_valid(bin)) {
+		fprintf(stderr, "Error: Binary image failed to load\n");
+		exit(1);
+	}
+	puts(XML_bin_get_attr(XML_bin_get_child(XML_bin_get_child(bin, "query"), "position"), "long"));
+	puts(XML_as_text(XML_bin_to_xml(bin)));
+	XML_Bin no_bin = XML_bin_get_child(bin, "nothing");
+	if (XML_bin_name(no_bin) || XML_bin_get_attr(no_bin, "a") || XML_bin_n_contents(no_bin)
+	 || XML_bin_is_valid(XML_bin_content(no_bin, 0)) || XML_bin_str(no_bin)
+	 || XML_is_valid(XML_bin_to_xml(no_bin)) || XML_bin_is_valid(XML_bin_content(bin, 99))) {
+		fprintf(stderr, "Error: Binary accessors followed an invalid handle\n");
+		exit(1);
+	}
+	char* damaged = XML_alloc_atomic(size);
+	memcpy(damaged, image, size);
+	XML_Bin damaged_bin = {damaged, bin.off};
+	XML_Bin damaged_query = XML_bin_get_child(damaged_bin, "query");
+	((XML_BinTag*)(damaged + damaged_query.off))->name = size + 5;
+	((XML_BinHeader*)damaged)->checksum = XML_bin_checksum(damaged, size);
+	damaged_bin = XML_load_binary(damaged, size);
+	damaged_query.off = ((const uint*)(damaged + XML_bin_tag(damaged_bin)->contents))[0];
+	if (!XML_bin_is_valid(damaged_bin) || XML_bin_name(damaged_query)
+	 || XML_bin_is_valid(XML_bin_get_child(damaged_bin, "query"))
+	 || XML_is_valid(XML_bin_to_xml(damaged_bin))) {
+		fprintf(stderr, "Error: Binary accessors followed an offset out of the image\n");
+		exit(1);
+	}
+	XML_Cache* cache = XML_cache_new(1 << 16);
+	const char* heartbeat = "<heartbeat seq=\"1\"/>";
+	XML_cache_parse(cache, heartbeat);
+	if (XML_cache_parse(cache, heartbeat).tag != XML_cache_parse(cache, "<heartbeat seq=\"1\"/>").tag
+	 || cache->hits != 2 || cache->misses != 1) {
+		fprintf(stderr, "Error: Parse cache missed identical input\n");
+		exit(1);
+	}
+	XML beat = XML_cache_parse(cache, heartbeat);
+	if (XML_set_attr(beat, "seq", "2") || 0!=strcmp(XML_get_attr(XML_cache_parse(cache, heartbeat), "seq"), "1")
+	 || 0!=strcmp(XML_get_attr(XML_with_attr(beat, "seq", "2"), "seq"), "2")) {
+		fprintf(stderr, "Error: A tree shared by the parse cache could be changed\n");
+		exit(1);
+	}
+#ifdef XML_POSIX
+	char cached_path [] = "/tmp/xml-c-cache-XXXXXX";
+	char swapped_path [] = "/tmp/xml-c-cache-XXXXXX";
+	FILE* cached_file = fdopen(mkstemp(cached_path), "wb");
+	fputs("<conf v=\"1\"/>", cached_file);
+	fclose(cached_file);
+	XML conf = XML_cache_parse_file(cache, cached_path);
+	cached_file = fdopen(mkstemp(swapped_path), "wb");
+	fputs("<conf v=\"2\"/>", cached_file);
+	fclose(cached_file);
+	rename(swapped_path, cached_path);
+	// Same size, and most likely within the same second
+	XML conf_again = XML_cache_parse_file(cache, cached_path);
+	remove(cached_path);
+	if (!XML_is_valid(conf) || !XML_is_valid(conf_again)
+	 || strcmp(XML_get_attr(conf_again, "v"), "2") != 0) {
+		fprintf(stderr, "Error: File cache gave back a replaced file\n");
+		exit(1);
+	}
+#endif
+	XML same_xml = XML_TAG("tag-name",
+		XML_ATTRS("attr-name-1", "attr-value-1", "attr-name-2", "attr-value-2"),
+		XML_CONTENTS(
+			XML_TEXT("Some text & stuff in the tag"),
+			XML_TAG("child-tag", XML_NONE, XML_NONE)
+		)
+	);
+	XML_Builder* b = XML_builder_new();
+	XML_builder_begin(b, "tag-name");
+	XML_builder_attr(b, "attr-name-1", "attr-value-1");
+	XML_builder_attr(b, "attr-name-2", "attr-value-2");
+	XML_builder_text(b, "Some text & stuff in the tag");
+	XML_builder_begin(b, "child-tag");
+	XML_builder_end(b);
+	XML built = XML_builder_end(b);
+	if (0!=strcmp(XML_as_text(same_xml), XML_as_text(my_xml))
+	 || 0!=strcmp(XML_as_text(built), XML_as_text(my_xml))
+	 || XML_set_attr(built, "attr-name-3", "x") || XML_append_child(built, XML_TEXT("more"))) {
+		fprintf(stderr, "Error: XML_TAG or XML_Builder disagrees with XML_tag\n");
+		exit(1);
+	}
+	XML_Writer* w = XML_writer_new(NULL, NULL);
+	XML_writer_open(w, "tag-name");
+	XML_writer_attr(w, "attr-name-1", "attr-value-1");
+	XML_writer_attr(w, "attr-name-2", "attr-value-2");
+	XML_writer_text(w, "Some text & stuff in the tag");
+	XML_writer_open(w, "child-tag");
+	XML_writer_close(w, "child-tag");
+	XML_writer_close(w, NULL);
+	if (0!=strcmp(XML_writer_finish(w), XML_as_text(my_xml))) {
+		fprintf(stderr, "Error: XML_Writer disagrees with XML_as_text\n");
+		exit(1);
+	}
+	XML_Arena* arena = XML_arena_new();
+	XML_Allocator arena_allocator = XML_arena_allocator(arena);
+	XML in_arena = XML_parse_with(&arena_allocator, XML_as_text(parsed));
+	if (!XML_is_valid(in_arena) || 0!=strcmp(XML_as_text(in_arena), XML_as_text(parsed))) {
+		fprintf(stderr, "Error: Parse into an arena failed\n");
+		exit(1);
+	}
+	XML_arena_destroy(arena);
+	XML_Template* tmpl = XML_compile(XML_tag("position",
+		"lat", XML_SLOT_TEXT(0),
+		"long", XML_SLOT_TEXT(1),
+		NULL,
+		XML_SLOT_INT(2),
+		XML_tag("note", NULL, XML_SLOT_RAW(3), NULL),
+		NULL
+	));
+	XML_Slot slots [] = {{.str = "23.01515"}, {.str = "<-15>"}, {.num = -42}, {.str = "<b/>"}};
+	if (0!=strcmp(XML_render(tmpl, slots), "<position lat=\"23.01515\" long=\"&lt;-15&gt;\">-42<note><b/></note></position>")) {
+		fprintf(stderr, "Error: Template rendered wrong\n");
+		exit(1);
+	}
+	XML_template_free(tmpl);
+	enum { NAME_SLOT, ID_SLOT };
+	uint next_slot = ID_SLOT + 1;
+	tmpl = XML_compile(XML_tag("user", "id", XML_SLOT_INT(ID_SLOT), NULL, XML_SLOT_TEXT(NAME_SLOT), XML_SLOT_RAW(next_slot), NULL));
+	XML_Slot named [] = {{.str = "Ann"}, {.num = 7}, {.str = "<x/>"}};
+	if (tmpl->n_slots != 3 || 0!=strcmp(XML_render(tmpl, named), "<user id=\"7\">Ann<x/></user>")) {
+		fprintf(stderr, "Error: Template slots given by name went to the wrong place\n");
+		exit(1);
+	}
+	XML_template_free(tmpl);
+	XML status = XML_parse("<status><a n=\"1\">x</a><b><c/></b></status>");
+	XML_track(status);
+	XML_as_text(status);
+	XML_set_attr(XML_get_child(status, "a"), "n", "2&");
+	XML_append_child(XML_get_child(XML_get_child(status, "b"), "c"), XML_tag("d", NULL, NULL));
+	XML_as_text(status);
+	XML_set_text(XML_get_child(status, "a"), "y");
+	XML_insert_child(status, 0, XML_TEXT("<"));
+	XML_remove_child(XML_get_child(status, "b"), 0);
+	if (0!=strcmp(XML_as_text(status), "<status>&lt;<a n=\"2&amp;\">y</a><b/></status>")
+	 || 0!=strcmp(XML_as_text(XML_get_child(status, "a")), "<a n=\"2&amp;\">y</a>")) {
+		fprintf(stderr, "Error: Tracked tree rendered wrong after changes\n");
+		exit(1);
+	}
+	char borrowed_value [8] = "1";
+	XML borrower = XML_parse("<a/>");
+	XML_append_child(borrower, XML_tag("b", "v", borrowed_value, NULL, NULL));
+	XML_as_text(borrower);
+	strcpy(borrowed_value, "<<<<<<");
+	if (0!=strcmp(XML_as_text(borrower), "<a><b v=\"&lt;&lt;&lt;&lt;&lt;&lt;\"/></a>")) {
+		fprintf(stderr, "Error: Borrowed string changed without the text following\n");
+		exit(1);
+	}
+	XML_hash(borrower);
+	strcpy(borrowed_value, "2");
+	if (!XML_equal(borrower, XML_parse("<a><b v=\"2\"/></a>"))) {
+		fprintf(stderr, "Error: Borrowed string changed without the hash following\n");
+		exit(1);
+	}
+	XML v1 = XML_freeze(XML_parse("<base><head/><body><item n=\"1\"/><item n=\"2\"/></body></base>"));
+	uint path [] = {1, 0};
+	XML v2 = XML_update(v1, path, 2, XML_with_attr(XML_at(v1, path, 2), "n", "one"));
+	XML v3 = XML_update(v2, path, 1, XML_appended(XML_at(v2, path, 1), XML_tag("item", NULL, NULL)));
+	if (XML_set_attr(v1, "n", "2")
+	 || XML_get_child(v3, "head").tag != XML_get_child(v1, "head").tag
+	 || 0!=strcmp(XML_as_text(v1), "<base><head/><body><item n=\"1\"/><item n=\"2\"/></body></base>")
+	 || 0!=strcmp(XML_as_text(v3), "<base><head/><body><item n=\"one\"/><item n=\"2\"/><item/></body></base>")) {
+		fprintf(stderr, "Error: Updating a frozen tree went wrong\n");
+		exit(1);
+	}
+	char refs [] = "&apos;&#65;&#x2603;&#128512;&bogus;&#xD800;&#;&amp&#1;&#xFFFE;&#9;&#0000000065;&#x00000000000041;&#000;&#x;";
+	XML_unescape_in_place(refs);
+	if (0!=strcmp(refs, "'A\xE2\x98\x83\xF0\x9F\x98\x80&bogus;&#xD800;&#;&amp&#1;&#xFFFE;\tAA&#000;&#x;")
+	 || 0!=strcmp(XML_get_attr(XML_parse("<a b=\"&lt;&#x3E;\"/>"), "b"), "<>")) {
+		fprintf(stderr, "Error: Entities or character references decoded wrong\n");
+		exit(1);
+	}
+	XML_ParseOptions strict = {XML_PARSE_VALIDATE_UTF8};
+	if (!XML_is_valid(XML_parse_opts("<a b=\"caf\xC3\xA9\">\tsnow \xE2\x98\x83 and more ascii text\n</a>", &strict))
+	 || XML_is_valid(XML_parse_opts("<a>bad \xC0\xAF overlong</a>", &strict))
+	 || XML_is_valid(XML_parse_opts("<a b=\"\xED\xA0\x80\"/>", &strict))
+	 || XML_is_valid(XML_parse_opts("<a>bell\x07</a>", &strict))
+	 || failspot != 7
+	 || !XML_is_valid(XML_parse("<a>bell\x07</a>"))
+	 || XML_is_valid(XML_parse_opts("<a>bell&#7;</a>", &strict))
+	 || failspot != 7
+	 || XML_is_valid(XML_parse_opts("<a b=\"&#xFFFE;\"/>", &strict))
+	 || !XML_is_valid(XML_parse_opts("<a b=\"&#x9;&amp;&bogus;\"><![CDATA[&#1;]]></a>", &strict))
+	 || XML_is_valid(XML_parse_lazy("<a>&#1;</a>", &strict))
+	 || XML_is_valid(XML_parse_opts("<!-- bad \xFF --><a/>", &strict))
+	 || failspot != 9
+	 || XML_is_valid(XML_parse_opts("<a/><!-- bad \xFF -->", &strict))
+	 || !XML_is_valid(XML_parse("<!-- bad \xFF --><a/>"))) {
+		fprintf(stderr, "Error: UTF-8 validation accepted or rejected the wrong input\n");
+		exit(1);
+	}
+	const char* feed = "\xEF\xBB\xBF<?xml version=\"1.0\"?>\n<!DOCTYPE feed [<!ENTITY x \"]>\">]>\n<!-- head -->"
+		"<feed><!-- note --><?render fast?><data><![CDATA[a<b>&amp;]]></data></feed>\n<!-- tail -->\n";
+	XML_ParseOptions keep = {XML_PARSE_KEEP_COMMENTS | XML_PARSE_KEEP_PIS};
+	XML fed = XML_parse(feed);
+	XML kept = XML_parse_opts(feed, &keep);
+	uint kept_size;
+	const char* kept_image = XML_save_binary(kept, &kept_size);
+	if (!XML_is_valid(fed)
+	 || 0!=strcmp(XML_as_text(fed), "<feed><data>a&lt;b&gt;&amp;amp;</data></feed>")
+	 || 0!=strcmp(XML_as_text(kept), "<feed><!-- note --><?render fast?><data>a&lt;b&gt;&amp;amp;</data></feed>")
+	 || 0!=strcmp(XML_as_text(XML_bin_to_xml(XML_load_binary(kept_image, kept_size))), XML_as_text(kept))
+	 || !XML_is_valid(XML_get_child(kept, "data"))
+	 || XML_is_valid(XML_parse("<a><![CDATA[x]]</a>"))
+	 || XML_is_valid(XML_parse("<a/><b/>"))) {
+		fprintf(stderr, "Error: Comments, PIs, CDATA or the prolog parsed wrong\n");
+		exit(1);
+	}
+	XML_ParseOptions nsopts = {XML_PARSE_NAMESPACES};
+	XML soap = XML_parse_opts("<soap:Envelope xmlns:soap=\"urn:soap\" xmlns=\"urn:app\"><soap:Body>"
+		"<Order xmlns:x=\"urn:x\" x:id=\"7\" id=\"8\" xml:lang=\"en\"><x:Item/><Item xmlns=\"\"/></Order>"
+		"</soap:Body></soap:Envelope>", &nsopts);
+	XML order = XML_get_child_ns(XML_get_child_ns(soap, XML_ns("urn:soap"), "Body"), XML_ns("urn:app"), "Order");
+	if (!XML_is_valid(order)
+	 || 0!=strcmp(XML_get_attr_ns(order, XML_ns("urn:x"), "id"), "7")
+	 || 0!=strcmp(XML_get_attr_ns(order, NULL, "id"), "8")
+	 || 0!=strcmp(XML_get_attr_ns(order, XML_ns("http://www.w3.org/XML/1998/namespace"), "lang"), "en")
+	 || !XML_is_valid(XML_get_child_ns(order, XML_ns("urn:x"), "Item"))
+	 || !XML_is_valid(XML_get_child_ns(order, NULL, "Item"))
+	 || XML_is_valid(XML_parse_opts("<a><b:c/></a>", &nsopts))
+	 || failspot != 3) {
+		fprintf(stderr, "Error: Namespaces resolved wrong\n");
+		exit(1);
+	}
+	XML ns_item = XML_get_child_ns(order, XML_ns("urn:x"), "Item");
+	XML_set_attr(ns_item, "x:ref", "1");
+	XML_set_attr(order, "soap:mustUnderstand", "1");
+	XML_set_attr(order, "nowhere:z", "2");
+	if (!XML_get_attr_ns(ns_item, XML_ns("urn:x"), "ref")
+	 || !XML_get_attr_ns(order, XML_ns("urn:soap"), "mustUnderstand")
+	 || !XML_get_attr_ns(order, XML_ns("urn:x"), "id")
+	 || 0!=strcmp(XML_get_attr(order, "nowhere:z"), "2")) {
+		fprintf(stderr, "Error: XML_set_attr didn't resolve a prefix\n");
+		exit(1);
+	}
+	const char* pretty = "<config>\n  <name> main </name>\n  <empty>\n  </empty>\n  <list>\n    <i>1</i>\n  </list>\n</config>\n";
+	XML_ParseOptions drop = {XML_PARSE_DROP_WHITESPACE};
+	XML_ParseOptions trim = {XML_PARSE_TRIM_TEXT};
+	if (0!=strcmp(XML_as_text(XML_parse_opts(pretty, &drop)), "<config><name> main </name><empty/><list><i>1</i></list></config>")
+	 || 0!=strcmp(XML_as_text(XML_parse_opts(pretty, &trim)), "<config><name>main</name><empty/><list><i>1</i></list></config>")) {
+		fprintf(stderr, "Error: Whitespace was dropped or trimmed wrong\n");
+		exit(1);
+	}
+	const char* catalog = "<catalog><item><price cur=\"EUR\">5</price></item><item><price cur=\"EUR\">5</price></item><item><price cur=\"USD\">5</price></item></catalog>";
+	XML_ConsTable* cons = XML_cons_new();
+	XML_ParseOptions consing = {0, cons};
+	XML shared = XML_parse_opts(catalog, &consing);
+	XML unshared = XML_parse(catalog);
+	XML changed = XML_parse(catalog);
+	uint64_t before = XML_hash(changed);
+	XML_set_attr(XML_get_child(XML_get_child(changed, "item"), "price"), "cur", "GBP");
+	if (shared.tag->contents[0].tag != shared.tag->contents[1].tag
+	 || shared.tag->contents[1].tag == shared.tag->contents[2].tag
+	 || cons->hits != 2
+	 || XML_hash(shared) != XML_hash(unshared)
+	 || !XML_equal(shared, unshared)
+	 || XML_hash(changed) == before
+	 || XML_equal(changed, unshared)) {
+		fprintf(stderr, "Error: Hashing or hash-consing went wrong\n");
+		exit(1);
+	}
+	XML_cons_free(cons);
+	const char* rows = "<rows><row status=\"active\" unit=\"kg\">ok</row><row status=\"active\" unit=\"kg\">ok</row>"
+		"<row status=\"inactive\" unit=\"&lt;kg&gt;\">a longer note that isn't shared</row></rows>";
+	XML_StrPool* strs = XML_pool_new(16);
+	XML_ParseOptions pooled = {0, NULL, strs};
+	XML pool_rows = XML_parse_opts(rows, &pooled);
+	XML row0 = pool_rows.tag->contents[0];
+	XML row1 = pool_rows.tag->contents[1];
+	if (!XML_is_valid(pool_rows)
+	 || 0!=strcmp(XML_as_text(pool_rows), XML_as_text(XML_parse(rows)))
+	 || XML_get_attr(row0, "status") != XML_get_attr(row1, "status")
+	 || row0.tag->contents[0].str != row1.tag->contents[0].str
+	 || row0.tag->name != pool_rows.tag->contents[2].tag->name
+	 || XML_pool_str(strs, "a longer note that isn't shared") == pool_rows.tag->contents[2].tag->contents[0].str
+	 || strs->hits != 9
+	 || strs->saved == 0
+	 || 0!=strcmp(XML_pool_str(strs, "o"), "o")
+	 || 0!=strcmp(XML_pool_str(strs, "ok!"), "ok!")
+	 || XML_pool_str(strs, "ok") != row0.tag->contents[0].str) {
+		fprintf(stderr, "Error: String pool shared the wrong strings\n");
+		exit(1);
+	}
+	XML_pool_free(strs);
+	const char* request = "<req><head id=\"7\"/><!-- opt --><body><big n=\"1\">lots &amp; lots</big><big/></body></req>";
+	XML lazy = XML_parse_lazy(request, NULL);
+	XML_Tag* lazy_root = lazy.tag;
+	uint was_lazy = lazy_root->flags & XML_LAZY && !lazy_root->n_contents;
+	XML head = XML_get_child(lazy, "head");
+	XML body = XML_get_child(lazy, "body");
+	XML_parse("<a><b></a>");
+	uint eager_failspot = failspot;
+	if (!was_lazy
+	 || lazy.tag->n_contents != 2
+	 || !(body.tag->flags & XML_LAZY)
+	 || 0!=strcmp(XML_get_attr(head, "id"), "7")
+	 || 0!=strcmp(XML_as_text(lazy), XML_as_text(XML_parse(request)))
+	 || body.tag->flags & XML_LAZY
+	 || XML_is_valid(XML_parse_lazy("<a><b></a>", NULL))
+	 || failspot != eager_failspot) {
+		fprintf(stderr, "Error: Lazy parse went wrong\n");
+		exit(1);
+	}
+	const char* routed = "<wwxtp><meta><id>1</id></meta><query><command>TEST</command><position lat=\"1\"/></query><payload>big</payload></wwxtp>";
+	const char* const route [] = {"wwxtp/query/command", NULL};
+	const char* const no_meta [] = {"meta", "position", NULL};
+	const char* const only_id [] = {"id", NULL};
+	XML_ParseOptions routing = {.paths = route};
+	XML_ParseOptions dropping = {.exclude = no_meta};
+	XML_ParseOptions picking = {.include = only_id};
+	const char* many_paths [XML_MAX_PATHS + 2];
+	uint k;
+	for (k = 0; k < XML_MAX_PATHS; k++) many_paths[k] = "wwxtp/meta/nothing";
+	many_paths[XML_MAX_PATHS - 1] = "wwxtp/query/command";
+	many_paths[XML_MAX_PATHS] = NULL;
+	XML_ParseOptions most_paths = {.paths = many_paths};
+	XML routed_most = XML_parse_opts(routed, &most_paths);
+	many_paths[XML_MAX_PATHS] = "wwxtp/payload";
+	many_paths[XML_MAX_PATHS + 1] = NULL;
+	XML routed_head = XML_parse_opts(routed, &routing);
+	uint routed_end = endspot;
+	if (0!=strcmp(XML_as_text(routed_head), "<wwxtp><query><command>TEST</command></query></wwxtp>")
+	 || 0!=strcmp(routed + routed_end, "<position lat=\"1\"/></query><payload>big</payload></wwxtp>")
+	 || 0!=strcmp(XML_as_text(XML_parse_opts(routed, &dropping)), "<wwxtp><query><command>TEST</command></query><payload>big</payload></wwxtp>")
+	 || 0!=strcmp(XML_as_text(XML_parse_opts(routed, &picking)), "<wwxtp><meta><id>1</id></meta></wwxtp>")
+	 || 0!=strcmp(XML_as_text(XML_parse_opts("<r>x<m a=\"1\">y<!--c--><![CDATA[z]]><n>z</n><id>1</id></m><id>2</id><o><p/></o></r>", &picking)),
+		"<r><m a=\"1\"><id>1</id></m><id>2</id></r>")
+	 || XML_is_valid(XML_parse_opts("<wwxtp><meta><id></meta></wwxtp>", &dropping))
+	 || XML_is_valid(XML_parse_opts("<wwxtp><query><command>x</command></query></wwxtp>junk", &dropping))
+	 || !XML_is_valid(XML_parse_opts("<wwxtp><query><command>x</command></query><oops></wwxtp>", &routing))
+	 || 0!=strcmp(XML_as_text(routed_most), "<wwxtp><meta/><query><command>TEST</command></query></wwxtp>")
+	 || XML_is_valid(XML_parse_opts(routed, &most_paths))) {
+		fprintf(stderr, "Error: Filtered parse kept the wrong elements\n");
+		exit(1);
+	}
+#ifdef XML_STATS
+	XML_Stats stats_before;
+	XML_Stats stats_after;
+	XML_stats_get(&stats_before);
+	XML_parse("<a b=\"&amp;\">x</a>");
+	XML_stats_get(&stats_after);
+	if (stats_after.allocs == stats_before.allocs
+	 || stats_after.nodes != stats_before.nodes + 1
+	 || stats_after.bytes_scanned != stats_before.bytes_scanned + 18) {
+		fprintf(stderr, "Error: Stats didn't count a parse\n");
+		exit(1);
+	}
+#endif
+	const char* stream = "<a>1</a>\n<b/>\r\n<?xml version=\"1.0\"?><!-- c --><wwxtp><query><command>x</command><z/></query></wwxtp><d>";
+	XML_Cursor cursor = XML_cursor(stream, NULL);
+	XML first = XML_parse_next(&cursor);
+	uint first_consumed = cursor.consumed;
+	XML second = XML_parse_next(&cursor);
+	XML_Cursor routed_cursor = XML_cursor(stream + cursor.at, &routing);
+	XML routed_next = XML_parse_next(&routed_cursor);
+	XML third = XML_parse_next(&cursor);
+	uint third_at = cursor.at;
+	XML cut_off = XML_parse_next(&cursor);
+	uint cut_failspot = failspot;
+	XML_Cursor trailing = XML_cursor("<a/> \n<!-- end -->\n", NULL);
+	XML_parse_next(&trailing);
+	XML_Cursor mismatched = XML_cursor("<a/><b></c>", NULL);
+	XML_parse_next(&mismatched);
+	if (0!=strcmp(XML_as_text(first), "<a>1</a>")
+	 || first_consumed != 9
+	 || 0!=strcmp(XML_as_text(second), "<b/>")
+	 || 0!=strcmp(XML_as_text(routed_next), "<wwxtp><query><command>x</command></query></wwxtp>")
+	 || 0!=strcmp(routed_cursor.src + routed_cursor.at, "<d>")
+	 || 0!=strcmp(XML_as_text(third), "<wwxtp><query><command>x</command><z/></query></wwxtp>")
+	 || XML_is_valid(cut_off)
+	 || cursor.at != third_at
+	 || 0!=strcmp(stream + cursor.at, "<d>")
+	 || cut_failspot != cursor.len
+	 || trailing.at != trailing.len
+	 || XML_is_valid(XML_parse_next(&trailing))
+	 || trailing.at != trailing.len
+	 || XML_is_valid(XML_parse_next(&mismatched))
+	 || failspot != 10
+	 || mismatched.at != 4) {
+		fprintf(stderr, "Error: Parsing concatenated documents went wrong\n");
+		exit(1);
+	}
+	const char* whole = "<?xml version=\"1.0\"?>\n<!DOCTYPE r>\n<!-- c --><r a=\"1 &amp; 2\" b = \"caf\xC3\xA9\">"
+		"<!-- x --><?pi d?><![CDATA[<z>]]>t&#x41;\xE2\x98\x83<s/><t k=\"v\" ></t ></r >";
+	XML_ParseOptions cut_opts [] = {{0}, {XML_PARSE_VALIDATE_UTF8 | XML_PARSE_KEEP_COMMENTS | XML_PARSE_KEEP_PIS}};
+	char prefix [256];
+	uint opt;
+	uint cut;
+	for (opt = 0; opt < 2; opt++)
+	for (cut = 1; cut <= strlen(whole); cut++) {
+		sprintf(prefix, "<a/>%.*s", (int)cut, whole);
+		XML_Cursor partial = XML_cursor(prefix, &cut_opts[opt]);
+		XML_parse_next(&partial);
+		uint before = partial.at;
+		XML rest = XML_parse_next(&partial);
+		if (cut == strlen(whole) ? !XML_is_valid(rest) || partial.at != partial.len
+		  : XML_is_valid(rest) || failspot != partial.len || (partial.at != before && partial.at != partial.len)) {
+			fprintf(stderr, "Error: Document cut off after %u bytes wasn't reported as cut off\n", cut);
+			exit(1);
+		}
+	}
+	long live = 0;
+	XML_Allocator counting = {XML_test_alloc, XML_test_realloc, XML_test_free, NULL, &live};
+	const XML_Allocator* old = XML_set_allocator(&counting);
+	uint i;
+	for (i = 0; i < 100; i++) {
+		XML doc = XML_parse("<wwxtp><query><command>TEST &amp; more</command><position lat=\"23.01515\" long=\"-15.132\"/></query></wwxtp>");
+		XML position = XML_get_child(XML_get_child(doc, "query"), "position");
+		XML response = XML_tag("response",
+			"lat", XML_get_attr(position, "lat"),
+			NULL,
+			"text",
+			XML_tag("child", NULL, NULL),
+			NULL
+		);
+		XML_track(response);
+		XML_dealloc((void*)XML_as_text(response));
+		XML_set_attr(response, "long", XML_get_attr(position, "long"));
+		XML_append_child(response, XML_TAG("more", XML_NONE, XML_NONE));
+		XML_dealloc((void*)XML_as_text(response));
+		XML_free(response);
+		XML_set_text(XML_get_child(XML_get_child(doc, "query"), "command"), "ANOTHER");
+		XML_remove_child(XML_get_child(doc, "query"), 1);
+		XML_set_attr(doc, "v", "2");
+		XML_free(XML_TAG("ok", XML_ATTRS("a", "b"), XML_CONTENTS(XML_TAG("c", XML_NONE, XML_NONE))));
+		uint size;
+		const char* image = XML_save_binary(doc, &size);
+		XML_free(XML_bin_to_xml(XML_load_binary(image, size)));
+		XML_Bin leak_bin = XML_load_binary(image, size);
+		XML_Bin leak_child = XML_bin_get_child(leak_bin, "query");
+		((XML_BinTag*)(image + leak_child.off))->name = size;
+		((XML_BinHeader*)image)->checksum = XML_bin_checksum(image, size);
+		XML_free(XML_bin_to_xml(XML_load_binary(image, size)));
+		XML_dealloc((void*)image);
+		XML_free(doc);
+		XML_free(XML_parse("<wwxtp><query a=\"1\"><command>TEST</command><pos"));
+		XML_free(XML_parse_n("<a>x</a>", 8));
+		XML_free(XML_parse_opts("<?xml version=\"1.0\"?><a><!--c--><?p d?><![CDATA[x]]></a><!--after-->", &keep));
+		XML_free(XML_parse("<a/>trailing"));
+		XML ns_doc = XML_parse_opts("<p:a xmlns:p=\"urn:p\" p:b=\"1\"><p:c/><d e:f=\"2\"/></p:a>", &nsopts);
+		XML_set_attr(ns_doc, "more", "x");
+		XML_free(ns_doc);
+		XML_free(XML_parse_opts("<p:a xmlns:p=\"urn:p\" p:b=\"1\"><p:c/></p:a>", &nsopts));
+		XML_ConsTable* leak_cons = XML_cons_new();
+		XML_ParseOptions leak_consing = {0, leak_cons};
+		XML_parse_opts("<a><b>x</b><b>x</b><c><b>x</b></c></a>", &leak_consing);
+		XML_parse_opts("<a><b>x</b><b>y</b><d/></a>junk", &leak_consing);
+		XML_cons_free(leak_cons);
+		XML_free(XML_parse_opts("<a b=\"1\"><c>ok</c>bad\xFF</a>", &strict));
+		XML_StrPool* leak_pool = XML_pool_new(16);
+		XML_ParseOptions leak_pooled = {XML_PARSE_KEEP_COMMENTS, NULL, leak_pool};
+		XML pool_doc = XML_parse_opts("<a b=\"x\"><!--c--><b b=\"x\">y</b>y</a>", &leak_pooled);
+		XML_set_attr(pool_doc, "b", "z");
+		XML_free(pool_doc);
+		XML_free(XML_parse_opts("<a b=\"x\"><b b=\"x\">y</b>y<c", &leak_pooled));
+		XML_pool_reset(leak_pool);
+		XML_free(XML_parse_opts("<a b=\"x\"/>", &leak_pooled));
+		XML_pool_free(leak_pool);
+		XML lazy_doc = XML_parse_lazy("<a b=\"1\"><c d=\"2\">x<e/></c><f/></a>", &keep);
+		XML_set_attr(XML_get_child(lazy_doc, "c"), "d", "3");
+		XML_free(lazy_doc);
+		XML_free(XML_parse_lazy("<a><b/></a>", NULL));
+		XML_free(XML_parse_lazy("<a><b></a>", NULL));
+		XML_free(XML_parse_lazy("<a><b><![CDATA[x]]></b></a>", NULL));
+		XML_free(XML_parse_opts(routed, &routing));
+		XML_free(XML_parse_opts(routed, &dropping));
+		XML_free(XML_parse_opts("<r>x<m>y<![CDATA[z]]><n>z</n><id>1</id></m><o><p/></o></r>", &picking));
+		XML_free(XML_parse_opts("<wwxtp><query><command>x</command><oops", &dropping));
+		XML_Cursor leak_cursor = XML_cursor(stream, &routing);
+		XML leak_next;
+		while (XML_is_valid(leak_next = XML_parse_next(&leak_cursor))) XML_free(leak_next);
+	}
+	XML_Cache* leak_cache = XML_cache_new(1024);
+	for (i = 0; i < 100; i++) {
+		char msg [32];
+		sprintf(msg, "<ping n=\"%u\"/>", i % 7);
+		XML_cache_release(leak_cache, XML_cache_parse(leak_cache, msg));
+	}
+	XML held = XML_cache_parse(leak_cache, "<held/>");
+	for (i = 0; i < 100; i++) {
+		char msg [32];
+		sprintf(msg, "<ping n=\"%u\"/>", i);
+		XML_cache_release(leak_cache, XML_cache_parse(leak_cache, msg));
+	}
+	if (!XML_is_valid(held) || strcmp(held.tag->name, "held") != 0) {
+		fprintf(stderr, "Error: Parse cache freed a tree that was still held\n");
+		exit(1);
+	}
+	XML_cache_release(leak_cache, held);
+	XML_cache_free(leak_cache);
+	long live_before_cache = live;
+	XML_Cache* tiny_cache = XML_cache_new(16);
+	XML big = XML_cache_parse(tiny_cache, "<too-big-to-keep/>");
+	XML big_again = XML_cache_parse(tiny_cache, "<too-big-to-keep/>");
+	if (!XML_is_valid(big) || big.tag == big_again.tag || tiny_cache->n_entries != 0) {
+		fprintf(stderr, "Error: Parse cache kept a tree bigger than itself\n");
+		exit(1);
+	}
+	XML_cache_release(tiny_cache, big);
+	XML_cache_free(tiny_cache);
+	tiny_cache = XML_cache_new(16);
+	XML_cache_release(tiny_cache, XML_cache_parse(tiny_cache, "<too-big-to-keep/>"));
+	if (live != live_before_cache + 3) {  // Just the cache and its two tables
+		fprintf(stderr, "Error: Parse cache kept a released oversize tree\n");
+		exit(1);
+	}
+	XML_cache_free(tiny_cache);
+	if (live != live_before_cache) {
+		fprintf(stderr, "Error: %ld allocations left after an oversize cache parse\n", live - live_before_cache);
+		exit(1);
+	}
+	XML_Writer* leak_writer = XML_writer_new(NULL, NULL);
+	XML_writer_open(leak_writer, "a");
+	XML_writer_close(leak_writer, NULL);
+	XML_writer_finish(leak_writer);
+	XML_writer_free(leak_writer);
+	XML_set_allocator(old);
+	if (live != 0) {
+		fprintf(stderr, "Error: %ld allocations left after freeing everything\n", live);
+		exit(1);
+	}
 }
 /*
 int main () {